@@ -0,0 +1,96 @@
+#include <iostream>
+#include <cstdio>
+#include <memory>
+#include <cmath>
+#include <random>
+
+#include "../include/Layer.hpp"
+#include "../include/Convolutional.hpp"
+#include "../include/Pooling.hpp"
+#include "../include/ConvolutionalPooling.hpp"
+#include "../include/Function.hpp"
+
+using namespace std;
+
+typedef Matrix<double> Mat;
+
+// largest difference of a and b relative to the largest element of b.
+double rel_diff ( const vector<Mat>& a, const vector<Mat>& b )
+{
+	double diff = 0.0, scale = 1.0;
+	for( int i = 0; i < a.size(); ++i )
+		for( int j = 0; j < a[i].m; ++j )
+			for( int k = 0; k < a[i].n; ++k ){
+				diff = max(diff, abs(a[i](j,k) - b[i](j,k)));
+				scale = max(scale, abs(b[i](j,k)));
+			}
+	return diff/scale;
+}
+
+vector<Mat> flatten ( const vector<vector<Mat>>& W )
+{
+	vector<Mat> ret;
+	for( auto& w : W ) ret.insert(ret.end(), w.begin(), w.end());
+	return ret;
+}
+
+// ConvolutionalPooling against Convolutional followed by Pooling with the same W
+// and bias, on an input of C maps of H x X units and O output maps of k x k filters.
+// As in Neuralnet, apply takes the input through the activation of the previous
+// layer and the backward passes take it before the activation.
+bool check ( int C, int H, int X, int O, int k, int stride, int pool, int pool_stride, int B,
+			 const shared_ptr<Function>& f )
+{
+	const int CH = (H + 2*(k/2) - k)/stride + 1, CW = (X + 2*(k/2) - k)/stride + 1;
+	const int PH = (CH - pool)/pool_stride + 1, PW = (CW - pool)/pool_stride + 1;
+	shared_ptr<Function> id(new Identity), prev_f(new Sigmoid);
+
+	Convolutional conv(C, H*X, X, O, CH*CW, CW, k, k, stride, f);
+	Pooling pooling(O, CH*CW, CW, O, PH*PW, PW, pool, pool, pool_stride, id);
+	ConvolutionalPooling fused(C, H*X, X, O, CH*CW, CW, k, k, stride, f, PH*PW, PW, pool, pool, pool_stride, id);
+	conv.set_prev_function(prev_f); pooling.set_prev_function(f); fused.set_prev_function(prev_f);
+
+	mt19937 mt(1);
+	conv.init(mt); pooling.init(mt); fused.init(mt);
+	conv.output_W("conv_pool_check.dat");
+	fused.set_W("conv_pool_check.dat");
+
+	uniform_real_distribution<double> d_rand(-1.0, 1.0);
+	vector<Mat> U(C, Mat(H*X, B)), delta(O, Mat(PH*PW, B));
+	for( auto& u : U ) for( int i = 0; i < u.m; ++i ) for( int j = 0; j < u.n; ++j ) u(i,j) = d_rand(mt);
+	for( auto& d : delta ) for( int i = 0; i < d.m; ++i ) for( int j = 0; j < d.n; ++j ) d(i,j) = d_rand(mt);
+	vector<Mat> A(C);
+	for( int c = 0; c < C; ++c ) A[c] = (*prev_f)(U[c], false);
+
+	auto V = conv.apply(A, false);
+	const double e_apply = rel_diff(fused.apply(A, false), pooling.apply(V, false));
+	// an apply of another mini-batch in between, after which the backward
+	// passes find the winners of U again.
+	fused.apply(vector<Mat>(C, Mat(H*X, 1)), false);
+	auto conv_delta = pooling.calc_delta(V, delta);
+	const double e_delta = rel_diff(fused.calc_delta(U, delta), conv.calc_delta(U, conv_delta));
+	auto nabla = conv.calc_gradient(U, conv_delta), fused_nabla = fused.calc_gradient(U, delta);
+	const double e_grad = rel_diff(flatten(fused_nabla), flatten(nabla));
+
+	// the bias follows d_bias of the last calc_gradient.
+	conv.update_W(nabla); fused.update_W(fused_nabla);
+	const double e_update = rel_diff(fused.apply(A, false), pooling.apply(conv.apply(A, false), false));
+
+	const bool ok = max(max(e_apply, e_delta), max(e_grad, e_update)) < 1.0E-10;
+	printf("%s C %d, %d x %d, O %d, filter %d, stride %d, pool %d/%d, B %d : %.2E %.2E %.2E %.2E\n",
+		   ok ? "ok  " : "FAIL", C, H, X, O, k, stride, pool, pool_stride, B, e_apply, e_delta, e_grad, e_update);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+	ok &= check(1, 12, 12, 4, 5, 1, 2, 2, 3, shared_ptr<Function>(new ReLU));
+	ok &= check(3, 13, 11, 5, 3, 1, 2, 2, 4, shared_ptr<Function>(new Sigmoid));
+	ok &= check(2, 14, 14, 3, 3, 2, 3, 2, 2, shared_ptr<Function>(new Tanh));
+	ok &= check(4, 28, 28, 8, 5, 1, 2, 2, 50, shared_ptr<Function>(new ReLU));
+	ok &= check(8, 9, 9, 6, 3, 1, 3, 3, 5, shared_ptr<Function>(new ReLU));
+	remove("conv_pool_check.dat");
+
+	return (ok ? 0 : 1);
+}
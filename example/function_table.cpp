@@ -0,0 +1,89 @@
+#include <iostream>
+#include <functional>
+#include <memory>
+#include <cmath>
+#include <chrono>
+
+#include "../include/Neuralnet.hpp"
+#include "../include/Layer.hpp"
+#include "../include/FullyConnected.hpp"
+#include "../include/Function.hpp"
+
+using namespace std;
+
+// elapsed seconds of func
+double measure ( const function<void()>& func )
+{
+	auto beg = chrono::system_clock::now();
+	func();
+	auto end = chrono::system_clock::now();
+	return chrono::duration_cast<chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+int main()
+{
+	const int table_size[] = { 64, 256, 1024, 4096, 16384 };
+	const double range = 8.0;
+	const int num_elem = 1<<22, num_data = 100000;
+
+	// throughput and accuracy of activation functions themselves.
+	Matrix<double> x(num_elem, 1);
+	for( int i = 0; i < num_elem; ++i ) x(i,0) = -10.0 + 20.0*i/(num_elem-1);
+
+	vector<pair<string, shared_ptr<Function>>> funcs;
+	funcs.emplace_back("Sigmoid", shared_ptr<Function>(new Sigmoid));
+	funcs.emplace_back("Tanh", shared_ptr<Function>(new Tanh));
+
+	printf("Function   table size |  Melem/s  | max abs error\n");
+	for( auto& f : funcs ){
+		Matrix<double> y_exact;
+		f.second->unset_table();
+		double t = measure([&]{ y_exact = (*f.second)(x, false); });
+		printf("%-10s      exact  | %9.2f |\n", f.first.c_str(), num_elem/t/1e6);
+
+		for( int size : table_size ){
+			Matrix<double> y;
+			f.second->set_table(size, range);
+			double t = measure([&]{ y = (*f.second)(x, false); });
+
+			double err = 0.0;
+			for( int i = 0; i < num_elem; ++i ) err = max(err, abs(y(i,0) - y_exact(i,0)));
+			printf("%-10s %10d  | %9.2f | %13.6E\n", f.first.c_str(), size, num_elem/t/1e6, err);
+		}
+		f.second->unset_table();
+	}
+
+	// accuracy loss on a network learned with exact functions.
+	Neuralnet net(shared_ptr<LossFunction>(new Square));
+	net.add_layer(shared_ptr<Layer>(new FullyConnected(1, 1, 1, 100, shared_ptr<Function>(new Tanh))));
+	net.add_layer(shared_ptr<Layer>(new FullyConnected(1, 100, 1, 100, shared_ptr<Function>(new Sigmoid))));
+	net.add_layer(shared_ptr<Layer>(new FullyConnected(1, 100, 1, 1, shared_ptr<Function>(new Identity))));
+
+	vector<vector<vector<double>>> lx(100, vector<vector<double>>(1, vector<double>(1))), ly = lx;
+	for( int i = 0; i < 100; ++i ){
+		lx[i][0][0] = -1.0 + 2.0/99.0*i;
+		ly[i][0][0] = cos(lx[i][0][0]);
+	}
+	net.set_EPS(1.0E-3);
+	net.set_BATCHSIZE(10);
+	net.learning(lx, ly, 100/10*100);
+
+	vector<Matrix<double>> X(1, Matrix<double>(1, num_data));
+	for( int i = 0; i < num_data; ++i ) X[0](0,i) = -1.0 + 2.0*i/(num_data-1);
+
+	vector<Matrix<double>> Y_exact;
+	net.set_function_table(false);
+	double t = measure([&]{ Y_exact = net.apply(X); });
+
+	printf("\nNetwork    table size | samples/s | max abs error of output\n");
+	printf("               exact  | %9.0f |\n", num_data/t);
+	for( int size : table_size ){
+		vector<Matrix<double>> Y;
+		net.set_function_table(true, size, range);
+		double t = measure([&]{ Y = net.apply(X); });
+
+		double err = 0.0;
+		for( int i = 0; i < num_data; ++i ) err = max(err, abs(Y[0](0,i) - Y_exact[0](0,i)));
+		printf("           %10d | %9.0f | %13.6E\n", size, num_data/t, err);
+	}
+}
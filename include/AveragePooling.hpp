@@ -0,0 +1,355 @@
+#ifndef AVERAGEPOOLING_HPP
+#define AVERAGEPOOLING_HPP
+
+#include "Layer.hpp"
+
+// Pooling by the mean of a window. The mean is taken over the input units in
+// the window, so the padding is not counted. A unit is a row of B samples of
+// a map, or of B samples of all maps in the interleaved layout, and the
+// windows add whole rows.
+class AveragePooling : public Layer
+{
+private:
+	int prev_ldu, ldu;
+	int m, n, stride, pad;
+	// inv_cnt[j] is the reciprocal of the number of input units in the window
+	// of the output unit j.
+	std::vector<double> inv_cnt;
+public:
+	AveragePooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+					int num_map, int num_unit, int ldu,
+					int m, int n, int stride,
+					const std::shared_ptr<Function>& f );
+	AveragePooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+					int num_map, int num_unit, int ldu,
+					int m, int n, int stride, int pad,
+					const std::shared_ptr<Function>& f );
+
+#ifdef USE_MPI
+	void init( std::mt19937& m, MPI_Comm inner_world, MPI_Comm outer_world );
+#else
+	void init( std::mt19937& m );
+#endif
+	void finalize();
+
+	std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	void update_W ( const std::vector<std::vector<Mat>>& dW );
+
+	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
+	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
+
+	void set_interleaved ( const bool interleaved );
+
+	void set_W ( const std::string& filename );
+	void output_W ( const std::string& filename );
+
+#ifdef USE_MPI
+	void param_mix ();
+#endif
+};
+
+AveragePooling::AveragePooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+								int num_map, int num_unit, int ldu,
+								int m, int n, int stride,
+								const std::shared_ptr<Function>& f )
+	: AveragePooling(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu, m, n, stride, 0, f)
+{
+}
+
+AveragePooling::AveragePooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+								int num_map, int num_unit, int ldu,
+								int m, int n, int stride, int pad,
+								const std::shared_ptr<Function>& f )
+{
+	this->prev_num_map = prev_num_map;
+	this->prev_num_unit = prev_num_unit;
+	this->prev_ldu = prev_ldu;
+
+	this->num_map = num_map;
+	this->num_unit = num_unit;
+	this->ldu = ldu;
+
+	t_apply = t_delta = t_grad = 0.0;
+	t_apply_init = t_apply_gemm = t_apply_repl = t_apply_comm = 0.0;
+	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
+	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
+
+	this->m = m; this->n = n; this->stride = stride; this->pad = pad;
+
+	int rank = 0;
+#ifdef USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	if( num_unit%ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of output on AveragePooling layer.\n");
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+		}
+	if( prev_num_unit%prev_ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of input on AveragePooling layer.\n");
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+		}
+	if( ldu != (prev_ldu + 2*pad - n)/stride + 1 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong output image width on AveragePooling layer.\n");
+			printf("          Estimate width = %d.\n", (prev_ldu + 2*pad - n)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+		}
+	if( num_unit/ldu != (prev_num_unit/prev_ldu + 2*pad - m)/stride + 1 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong output image height on AveragePooling layer.\n");
+			printf("          Estimate height = %d.\n", (prev_num_unit/prev_ldu + 2*pad - m)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+		}
+
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	inv_cnt = std::vector<double>(num_unit, 0.0);
+	for( int j = 0; j < num_unit; ++j ){
+		const int y = j/ldu, x = j%ldu;
+		const int cnt = (std::min(Y, stride*y - pad + m) - std::max(0, stride*y - pad))*
+			(std::min(X, stride*x - pad + n) - std::max(0, stride*x - pad));
+		if( cnt > 0 ) inv_cnt[j] = 1.0/cnt;
+	}
+
+	func = f;
+}
+
+#ifdef USE_MPI
+void AveragePooling::init ( std::mt19937& m, MPI_Comm inner_world, MPI_Comm outer_world )
+#else
+void AveragePooling::init ( std::mt19937& m )
+#endif
+{
+#ifdef USE_MPI
+	this->inner_world = inner_world;
+	this->outer_world = outer_world;
+
+	MPI_Comm_rank(inner_world, &rank);
+	MPI_Comm_size(inner_world, &nprocs);
+#endif
+
+	W = std::vector<std::vector<Mat>>();
+}
+
+void AveragePooling::finalize ()
+{
+
+}
+
+std::vector<std::vector<AveragePooling::Mat>> AveragePooling::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	return std::vector<std::vector<Mat>>();
+}
+
+// Each own input unit takes delta of the windows covering it, so no unit is
+// written twice and nothing of apply has to be kept.
+std::vector<AveragePooling::Mat> AveragePooling::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = (is_interleaved ? U[0].m/prev_num_unit : U[0].n), len = (is_interleaved ? B*prev_num_map : B);
+	int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*len;
+		offset[i] = i*prev_num_unit/nprocs*len;
+	}
+
+	my_size = size[rank]/len;
+	my_offset = offset[rank]/len;
+#endif
+
+	const int OY = num_unit/ldu, OX = ldu;
+	std::vector<Mat> nx_delta(U.size(), Mat(U[0].m, U[0].n));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	for( int i = 0; i < U.size(); ++i ){
+		const double* d = &delta[i](0,0);
+		double* g = &nx_delta[i](0,0);
+#pragma omp parallel for
+		for( int j = my_offset; j < my_offset + my_size; ++j ){
+			const int y = j/prev_ldu, x = j%prev_ldu;
+			// output units whose windows cover (y, x).
+			const int oy0 = std::max(0, (y + pad - m + stride)/stride), oy1 = std::min(OY, (y + pad)/stride + 1);
+			const int ox0 = std::max(0, (x + pad - n + stride)/stride), ox1 = std::min(OX, (x + pad)/stride + 1);
+			double* w = g + (long long)j*len;
+			std::fill(w, w + len, 0.0);
+
+			for( int oy = oy0; oy < oy1; ++oy )
+				for( int ox = ox0; ox < ox1; ++ox ){
+					const int o = oy*OX + ox;
+					const double c = inv_cnt[o];
+					const double* a = d + (long long)o*len;
+					for( int k = 0; k < len; ++k ) w[k] += c*a[k];
+				}
+		}
+	}
+	end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	std::vector<MPI_Request> req(nx_delta.size());
+	for( int i = 0; i < nx_delta.size(); ++i )
+		MPI_Iallgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+						&nx_delta[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world, &req[i]);
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	for( int i = 0; i < nx_delta.size(); ++i ){
+#ifdef USE_MPI
+		beg = std::chrono::system_clock::now();
+		MPI_Status stat;
+		MPI_Wait(&req[i], &stat);
+		end = std::chrono::system_clock::now();
+		t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+		beg = std::chrono::system_clock::now();
+		nx_delta[i] = Mat::hadamard(nx_delta[i], (*prev_func)(U[i], true));
+		end = std::chrono::system_clock::now();
+		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	}
+
+	end = std::chrono::system_clock::now();
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+void AveragePooling::update_W ( const std::vector<std::vector<Mat>>& dW )
+{
+
+}
+
+std::vector<AveragePooling::Mat> AveragePooling::apply ( const std::vector<Mat>& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = (is_interleaved ? U[0].m/prev_num_unit : U[0].n), len = (is_interleaved ? B*num_map : B);
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*len;
+		offset[i] = i*num_unit/nprocs*len;
+	}
+
+	my_size = size[rank]/len;
+	my_offset = offset[rank]/len;
+#endif
+
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	std::vector<Mat> ret(U.size(), is_interleaved ? Mat(num_unit*B, num_map) : Mat(num_unit, B));
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	for( int i = 0; i < U.size(); ++i ){
+		beg = std::chrono::system_clock::now();
+		const Mat U_ = (*prev_func)(U[i], false);
+		end = std::chrono::system_clock::now();
+		t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		beg = std::chrono::system_clock::now();
+		const double* u = &U_(0,0);
+		double* v = &ret[i](0,0);
+#pragma omp parallel for
+		for( int j = my_offset; j < my_offset + my_size; ++j ){
+			const int y = j/ldu, x = j%ldu;
+			const int y0 = std::max(0, stride*y - pad), y1 = std::min(Y, stride*y - pad + m);
+			const int x0 = std::max(0, stride*x - pad), x1 = std::min(X, stride*x - pad + n);
+			double* w = v + (long long)j*len;
+			std::fill(w, w + len, 0.0);
+
+			for( int ny = y0; ny < y1; ++ny )
+				for( int nx = x0; nx < x1; ++nx ){
+					const double* a = u + (long long)(ny*prev_ldu + nx)*len;
+					for( int k = 0; k < len; ++k ) w[k] += a[k];
+				}
+			for( int k = 0; k < len; ++k ) w[k] *= inv_cnt[j];
+		}
+		end = std::chrono::system_clock::now();
+		t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	}
+
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	std::vector<MPI_Request> req(ret.size());
+	for( int i = 0; i < ret.size(); ++i )
+		MPI_Iallgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+						&ret[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world, &req[i]);
+	for( int i = 0; i < ret.size(); ++i ){
+		MPI_Status stat;
+		MPI_Wait(&req[i], &stat);
+	}
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	if( use_func )
+		for( int i = 0; i < ret.size(); ++i )
+			ret[i] = (*func)(ret[i], false);
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	end = std::chrono::system_clock::now();
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return ret;
+}
+
+std::vector<std::vector<AveragePooling::Vec>> AveragePooling::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
+{
+	std::vector<Mat> tmp(prev_num_map);
+	for( int i = 0; i < prev_num_map; ++i )
+		tmp[i] = Mat(u[0][0].size(), u.size());
+
+	for( int i = 0; i < prev_num_map; ++i )
+		for( int j = 0; j < u[0][0].size(); ++j )
+			for( int k = 0; k < u.size(); ++k )
+				tmp[i](j,k) = u[k][i][j];
+
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
+	std::vector<std::vector<Vec>> ret(U[0].n);
+	for( int i = 0; i < U[0].n; ++i ){
+		ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
+		for( int j = 0; j < U.size(); ++j )
+			for( int k = 0; k < U[0].m; ++k )
+				ret[i][j][k] = U[j](k,i);
+	}
+
+	return ret;
+}
+
+void AveragePooling::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+}
+
+void AveragePooling::set_W ( const std::string& filename )
+{
+	std::ifstream ifs(filename, std::ios::binary);
+}
+
+void AveragePooling::output_W ( const std::string& filename )
+{
+	std::ofstream ofs(filename, std::ios::binary);
+}
+
+#ifdef USE_MPI
+void AveragePooling::param_mix ()
+{
+
+}
+#endif
+
+#endif
@@ -19,6 +19,10 @@ private:
 		EPS = 1.0E-8;
 		decay = 0.999;	//@@@ add
 	}
+
+	std::vector<std::vector<Mat>> calc_gradient_interleaved ( const Mat& U, const Mat& delta );
+	std::vector<Mat> calc_delta_interleaved ( const Mat& U, const Mat& delta );
+	std::vector<Mat> apply_interleaved ( const Mat& U, bool use_func );
 public:
 	BatchNormalize( int prev_num_map, int prev_num_unit,
 					const std::shared_ptr<Function>& f );
@@ -37,6 +41,8 @@ public:
 	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
 	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
 
+	void set_interleaved ( const bool interleaved );
+
 	void set_W ( const std::string& filename );
 	void output_W ( const std::string& filename );
 	
@@ -113,6 +119,8 @@ void BatchNormalize::finalize ()
 
 std::vector<std::vector<BatchNormalize::Mat>> BatchNormalize::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
 {
+	if( is_interleaved ) return calc_gradient_interleaved(U[0], delta[0]);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 	int my_offset, my_size;
@@ -170,6 +178,8 @@ std::vector<std::vector<BatchNormalize::Mat>> BatchNormalize::calc_gradient ( co
 
 std::vector<BatchNormalize::Mat> BatchNormalize::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
 {
+	if( is_interleaved ) return calc_delta_interleaved(U[0], delta[0]);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
@@ -247,6 +257,8 @@ void BatchNormalize::update_W ( const std::vector<std::vector<Mat>>& dW )
 
 std::vector<BatchNormalize::Mat> BatchNormalize::apply ( const std::vector<Mat>& U, bool use_func )
 {
+	if( is_interleaved ) return apply_interleaved(U[0], use_func);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
@@ -368,6 +380,187 @@ std::vector<BatchNormalize::Mat> BatchNormalize::apply ( const std::vector<Mat>&
 	return ret;
 }
 
+// The interleaved layout normalizes all maps of a unit at once.
+std::vector<std::vector<BatchNormalize::Mat>> BatchNormalize::calc_gradient_interleaved ( const Mat& U, const Mat& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = num_map;
+	int my_offset = 0, my_size = prev_num_unit;
+#ifdef USE_MPI
+	my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
+	my_offset = rank*prev_num_unit/nprocs;
+#endif
+	std::vector<std::vector<Mat>> nabla(1, std::vector<Mat>(num_map, Mat(1, 2)));
+	auto U_appl = (*prev_func)(U, false);
+	std::vector<double> sum(2*C, 0.0);
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel
+	{
+		std::vector<double> tmp_sum(2*C, 0.0);
+#pragma omp for nowait
+		for( int j = 0; j < my_size; ++j )
+			for( int k = 0; k < B; ++k ){
+				const double* d = &delta((my_offset + j)*B + k, 0);
+				const double* u = &U_appl((my_offset + j)*B + k, 0);
+				for( int i = 0; i < C; ++i ){
+					tmp_sum[i] += d[i]*(u[i] - mean(i,j))/std::sqrt(var(i,j) + EPS);
+					tmp_sum[C + i] += d[i];
+				}
+			}
+#pragma omp critical
+		for( int i = 0; i < 2*C; ++i ) sum[i] += tmp_sum[i];
+	}
+	end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE, &sum[0], 2*C, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_grad_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	for( int i = 0; i < C; ++i ){
+		nabla[0][i](0,0) = sum[i]; nabla[0][i](0,1) = sum[C + i];
+	}
+	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	cnt_flop += num_map*(my_size*B*5 + my_size*B*1);
+
+	return nabla;
+}
+
+std::vector<BatchNormalize::Mat> BatchNormalize::calc_delta_interleaved ( const Mat& U, const Mat& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = num_map;
+	int my_offset = 0, my_size = prev_num_unit;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*B*C;
+		offset[i] = i*prev_num_unit/nprocs*B*C;
+	}
+	my_size = size[rank]/(B*C);
+	my_offset = offset[rank]/(B*C);
+#endif
+
+	std::vector<Mat> nx_delta(1, Mat(prev_num_unit*B, C));
+	auto U_appl = (*prev_func)(U, false);
+	auto U_diff = (*prev_func)(U, true);
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel
+	{
+		std::vector<double> tmp1(C), tmp2(C);
+#pragma omp for nowait
+		for( int j = 0; j < my_size; ++j ){
+			const int r = (my_offset + j)*B;
+			for( int i = 0; i < C; ++i ) tmp1[i] = tmp2[i] = 0.0;
+			for( int k = 0; k < B; ++k )
+				for( int i = 0; i < C; ++i ){
+					tmp1[i] += delta(r + k, i);
+					tmp2[i] += delta(r + k, i)*(U_appl(r + k, i) - mean(i,j));
+				}
+			for( int i = 0; i < C; ++i ){
+				tmp1[i] /= B; tmp2[i] /= B;
+			}
+
+			for( int k = 0; k < B; ++k )
+				for( int i = 0; i < C; ++i )
+					nx_delta[0](r + k, i) = W[0][i](0,0)/sqrt(var(i,j) + EPS)*delta(r + k, i)*U_diff(r + k, i)
+						- W[0][i](0,0)/sqrt(var(i,j) + EPS)*U_diff(r + k, i)*tmp1[i]
+						- W[0][i](0,0)/pow(var(i,j) + EPS, 1.5)*U_diff(r + k, i)*(U_appl(r + k, i) - mean(i,j))*tmp2[i];
+		}
+	}
+	end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+				   &nx_delta[0](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	cnt_flop += num_map*(my_size*B*(4 + 2 + 19));
+
+	return nx_delta;
+}
+
+std::vector<BatchNormalize::Mat> BatchNormalize::apply_interleaved ( const Mat& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/num_unit, C = num_map;
+	int my_offset = 0, my_size = num_unit;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*B*C;
+		offset[i] = i*num_unit/nprocs*B*C;
+	}
+	my_size = size[rank]/(B*C);
+	my_offset = offset[rank]/(B*C);
+#endif
+	mean = var = Mat::zeros(num_map, my_size);
+
+	std::vector<Mat> ret(1, Mat(num_unit*B, C));
+	Mat tmp_ret(my_size*B, C);
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int j = 0; j < my_size; ++j ){
+		const int r = (my_offset + j)*B;
+		for( int k = 0; k < B; ++k )
+			for( int i = 0; i < C; ++i ) mean(i,j) += U(r + k, i);
+		for( int i = 0; i < C; ++i ) mean(i,j) /= B;
+
+		for( int k = 0; k < B; ++k )
+			for( int i = 0; i < C; ++i ){
+				double v = U(r + k, i) - mean(i,j);
+				var(i,j) += v*v;
+			}
+		for( int i = 0; i < C; ++i ) var(i,j) /= B;
+
+		for( int k = 0; k < B; ++k )
+			for( int i = 0; i < C; ++i )
+				tmp_ret(j*B + k, i) = W[0][i](0,0)*(U(r + k, i) - mean(i,j))/std::sqrt(var(i,j)+EPS) + W[0][i](0,1);
+	}
+	if( use_func ) tmp_ret = (*func)(tmp_ret, false);
+	end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allgatherv(&tmp_ret(0,0), size[rank], MPI_DOUBLE_PRECISION,
+				   &ret[0](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+#else
+	ret[0] = tmp_ret;
+#endif
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	cnt_flop += num_map*B*my_size + num_map*B*my_size*3 + num_map*B*my_size*5;
+
+	return ret;
+}
+
 std::vector<std::vector<BatchNormalize::Vec>> BatchNormalize::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
 {
 	std::vector<Mat> tmp(prev_num_map);
@@ -383,7 +576,7 @@ std::vector<std::vector<BatchNormalize::Vec>> BatchNormalize::apply ( const std:
 					tmp[i](j,k) = u[k][i][j];
 	}
 	
-	auto U = apply(tmp, use_func);
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n, std::vector<Vec>(U.size(), Vec(U[0].m)));
 #pragma omp parallel for
 	for( int i = 0; i < U[0].n; ++i ){
@@ -395,6 +588,11 @@ std::vector<std::vector<BatchNormalize::Vec>> BatchNormalize::apply ( const std:
 	return ret;
 }
 
+void BatchNormalize::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+}
+
 void BatchNormalize::set_W ( const std::string& filename )
 {
 	std::ifstream ifs(filename, std::ios::binary);
@@ -2,25 +2,171 @@
 #define CONVOLUTIONAL_HPP
 
 #include <fstream>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 #include "Layer.hpp"
+#include "FFT.hpp"
 
 class Convolutional : public Layer
 {
+public:
+	// Algorithm of each pass, AUTO chooses one by the shape of the layer.
+	enum Algorithm { AUTO, IM2COL, DIRECT, WINOGRAD_2X2, WINOGRAD_4X4, FFT };
+	// SAME gives ceil(size/stride) outputs by padding both sides evenly, the
+	// extra one goes to the bottom or right. VALID has no padding.
+	enum Padding { SAME, VALID };
+	// Split of the passes over the ranks of inner_world under MPI. UNIT gives
+	// each rank a share of the output units of all maps, MAP a share of the
+	// output maps over all units.
+	enum Partition { UNIT, MAP };
 private:
 	int prev_ldu, ldu;
-	int m, n, stride, pad;
-	int once_num;
-
+	int m, n, stride;
+	// distance between the taps of the filter along the rows and the columns,
+	// the filter spans (m-1)*dilation_y+1 x (n-1)*dilation_x+1 input units.
+	int dilation_y, dilation_x;
+	// input and output maps are split into groups, and the output maps of a
+	// group see only the input maps of the same group.
+	int groups;
+	int pad_top, pad_bottom, pad_left, pad_right;
+
+	// Number of samples in one GEMM of im2col for apply, calc_delta and
+	// calc_gradient. 0 is chosen on the first batches, which try candidates
+	// from the cache size and once_budget and keep the fastest one per sample.
+	// The budget is also bounded by the limit of the workspace.
+	int once_num[3];
+	long long once_budget;
+	std::vector<int> once_cand[3];
+	std::vector<double> once_time[3];
+	int get_once_num ( const int pass, const int rows, const int B );
+	void set_once_time ( const int pass, const double t );
+	void setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+				 int num_map, int num_unit, int ldu,
+				 int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+				 const std::shared_ptr<Function>& f, bool use_bias, int groups, int dilation_y, int dilation_x );
+
+	// delta_idx covers the output units [delta_beg, delta_end) whose receptive
+	// fields overlap own input units. im2col copies runs of the rows and needs
+	// no tables, so they are built on the first use by the other passes.
 	std::vector<int> feed_idx, delta_idx;
+	int delta_beg, delta_end;
+	const int* get_feed_idx ();
+	const int* get_delta_idx ();
+	static inline int run_begin ( const int base, const int stride, const int v );
+	void im2col_runs ( const Mat& U, const int q, const int j0, const int nt, const int i, const int size, double* x ) const;
+	void col2im_runs ( const double* x, const int q, const int j0, const int nt, const int i, const int size,
+					   Mat& V, const int lo, const int hi ) const;
+
+	// W reshaped for the GEMMs of apply and calc_delta, holding only the blocks
+	// of the groups. These are built on demand and cleared whenever W is changed.
+	Mat kernel_apply, kernel_delta;
+	void build_kernel ( const bool is_delta );
+	void clear_kernel ();
+
+	// Winograd transforms of W for apply and calc_delta, the tile size is
+	// known from their number of rows. Transformed images are in the workspace.
+	Mat wino_apply, wino_delta;
+	double *wino_in, *wino_out;
+	bool is_winograd_supported () const;
+	// 1x1 filters of stride 1 without padding read only the same unit of the
+	// input, and every pass is a GEMM over the maps with no index tables.
+	bool is_pointwise () const;
+	static void winograd_matrix ( const int tile, const double*& BT, const double*& G, const double*& AT );
+	void winograd_filter ( const int tile, const bool is_delta, Mat& filter ) const;
+	void winograd ( const int tile, const Mat& filter, const std::vector<Mat>& in, std::vector<Mat>& out,
+					const int my_offset, const int my_size, double& t_repl, double& t_gemm );
+
+	// Frequency domain filters of FFT for apply and calc_delta on their grids of
+	// P x Q, built on demand and cleared with the other kernels.
+	std::vector<double> fft_apply, fft_delta;
+	int fft_apply_P, fft_apply_Q, fft_delta_P, fft_delta_Q;
+	double *fft_in, *fft_out;
+	void fft_plan ( const int pass, const int beg, const int end, int& rows, int& P, int& Q ) const;
+	void fft_delta_rows ( const int a, const int b, int& oa, int& ob ) const;
+	int fft_chunk ( const int P, const int Q, const int B ) const;
+	double fft_cost ( const int pass ) const;
+	void fft_filter ( const RealFFT2D& fft, const bool is_delta, std::vector<double>& filter ) const;
+	void fft_pack_input ( const RealFFT2D& fft, const std::vector<Mat>& U, const int r0, const int H, const int b0, const int bc );
+	static void fft_multiply ( const int PQ, const int no, const int ni, const double* filter, const double* in, double* out, const int bc );
+
+	// With MAP the rank computes the output maps [map_beg, map_end) by part, a
+	// layer of those maps and the input maps of their groups only. W of part
+	// is copied again after W is changed.
+	Partition partition;
+	int map_beg, map_end;
+	std::shared_ptr<Convolutional> part;
+	bool is_part_stale;
+#ifdef USE_MPI
+	bool is_map_split () const;
+	void map_range ( const int r, int& beg, int& end ) const;
+	void setup_part ();
+	std::vector<Mat> slice_maps ( const std::vector<Mat>& U, const int beg, const int end ) const;
+	void apply_maps ( const std::vector<Mat>& U, std::vector<Mat>& ret );
+	void calc_gradient_maps ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla );
+	void calc_delta_maps ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<Mat>& nx_delta );
+	void expand_part_delta ( std::vector<Mat>& nx_delta, const int B ) const;
+	void reduce_delta_maps ( std::vector<Mat>& nx_delta, const std::vector<int>& size, const std::vector<int>& offset );
+#endif
+
+	Algorithm algo_apply, algo_delta, algo_grad;
+	// calc_backward lets calc_gradient compute nx_delta of calc_delta from the
+	// same expansion of delta, and calc_delta takes it from backward_delta.
+	bool is_backward;
+	std::vector<Mat> backward_delta;
+	Algorithm choose_algorithm ( const Algorithm& algo, const int& pass ) const;
+
+	void apply_im2col ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size );
+	void apply_direct ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size );
+	void apply_fft ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size );
+	void calc_delta_im2col ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size );
+	void calc_delta_direct ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size );
+	void calc_delta_fft ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size );
+	void calc_gradient_im2col ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla );
+	void calc_gradient_direct ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla );
+	void calc_gradient_fft ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla );
+	void calc_backward_im2col ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla,
+								std::vector<Mat>& nx_delta, const int my_offset, const int my_size );
+	void apply_interleaved ( const Mat& U, Mat& ret, const int my_offset, const int my_size );
+	void calc_delta_interleaved ( const Mat& delta, Mat& nx_delta, const int my_offset, const int my_size );
+	void calc_gradient_interleaved ( const Mat& U, const Mat& delta, std::vector<std::vector<Mat>>& nabla );
+	void apply_pointwise ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size );
+	void calc_delta_pointwise ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size );
+	void calc_gradient_pointwise ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla );
+
+	static inline void axpy_block ( const int no, const int len, const double* w, const double* x, double* const* y );
+	static inline void fma_block ( const int no, const int len, const double* const* d, const double* x, double* const* y );
+	static inline void gemm_block ( const int no, const int nk, const int len, const double* w, const int ldw,
+									const double* const* x, double* const* y );
 
 	Vec r, v;
 	double beta_, gamma_;
+
+	// the fused layer keeps its filters in a Convolutional and uses its kernel,
+	// feed_idx and im2col.
+	friend class ConvolutionalPooling;
 public:
 	Vec bias, d_bias;
+	// size of the L2 cache in bytes, which bounds the tiles of im2col.
+	static long long cache_size ();
+
+	// padding of dilation_y*(m/2) and dilation_x*(n/2) on each side. W[i] has prev_num_map/groups filters
+	// for the input maps of the group of the output map i.
 	Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
 				   int num_map, int num_unit, int ldu,
 				   int m, int n, int stride, 
-				   const std::shared_ptr<Function>& f, bool use_bias = true );
+				   const std::shared_ptr<Function>& f, bool use_bias = true, int groups = 1,
+				   int dilation_y = 1, int dilation_x = 1 );
+	Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+				   int num_map, int num_unit, int ldu,
+				   int m, int n, int stride, Padding padding,
+				   const std::shared_ptr<Function>& f, bool use_bias = true, int groups = 1,
+				   int dilation_y = 1, int dilation_x = 1 );
+	Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+				   int num_map, int num_unit, int ldu,
+				   int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+				   const std::shared_ptr<Function>& f, bool use_bias = true, int groups = 1,
+				   int dilation_y = 1, int dilation_x = 1 );
 
 #ifdef USE_MPI
 	void init( std::mt19937& mt, MPI_Comm inner_world, MPI_Comm outer_world );
@@ -31,6 +177,8 @@ public:
 	
 	std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
 	std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	std::vector<std::vector<Mat>> calc_backward ( const std::vector<Mat>& U, const std::vector<Mat>& delta,
+												  std::vector<Mat>& nx_delta, const bool need_delta = true );
 	void update_W ( const std::vector<std::vector<Mat>>& dW );
 
 	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
@@ -38,9 +186,18 @@ public:
 	std::vector<Mat> deconvolution ( const std::vector<Mat>& U );
 	std::vector<std::vector<Vec>> deconvolution ( const std::vector<std::vector<Vec>>& u );
 
+	// 0 chooses once_num automatically, the budget limits its buffers in bytes.
 	void set_once_num ( const int& once_num );
+	void set_once_budget ( const long long& bytes );
+	void set_algorithm ( const Algorithm& apply, const Algorithm& delta, const Algorithm& grad );
+	void set_interleaved ( const bool interleaved );
+	void set_spatial ( const bool spatial );
+	void set_partition ( const Partition& partition );
+#ifdef USE_MPI
+	void halo_range ( const bool is_delta, const int r, int& lo, int& hi );
+#endif
 	
-
+	void set_W ( const std::vector<std::vector<Mat>>& W );
 	void set_W ( const std::string& filename );
 	void output_W ( const std::string& filename );
 	
@@ -52,9 +209,55 @@ public:
 Convolutional::Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
 							  int num_map, int num_unit, int ldu,
 							  int m, int n, int stride, 
-							  const std::shared_ptr<Function>& f, bool use_bias )
+							  const std::shared_ptr<Function>& f, bool use_bias, int groups,
+							  int dilation_y, int dilation_x )
+{
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu,
+		  m, n, stride, dilation_y*(m/2), dilation_y*(m/2), dilation_x*(n/2), dilation_x*(n/2), f, use_bias, groups, dilation_y, dilation_x);
+}
+
+Convolutional::Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+							  int num_map, int num_unit, int ldu,
+							  int m, int n, int stride, Padding padding,
+							  const std::shared_ptr<Function>& f, bool use_bias, int groups,
+							  int dilation_y, int dilation_x )
+{
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	const int ext_y = (m - 1)*dilation_y + 1, ext_x = (n - 1)*dilation_x + 1;
+	int pad_y = 0, pad_x = 0;
+	if( padding == SAME ){
+		pad_y = std::max(0, ((Y + stride - 1)/stride - 1)*stride + ext_y - Y);
+		pad_x = std::max(0, ((X + stride - 1)/stride - 1)*stride + ext_x - X);
+	}
+
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu,
+		  m, n, stride, pad_y/2, pad_y - pad_y/2, pad_x/2, pad_x - pad_x/2, f, use_bias, groups, dilation_y, dilation_x);
+}
+
+Convolutional::Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+							  int num_map, int num_unit, int ldu,
+							  int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+							  const std::shared_ptr<Function>& f, bool use_bias, int groups,
+							  int dilation_y, int dilation_x )
 {
-	this->once_num = 1;
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu,
+		  m, n, stride, pad_top, pad_bottom, pad_left, pad_right, f, use_bias, groups, dilation_y, dilation_x);
+}
+
+void Convolutional::setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+							int num_map, int num_unit, int ldu,
+							int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+							const std::shared_ptr<Function>& f, bool use_bias, int groups,
+							int dilation_y, int dilation_x )
+{
+	once_num[0] = once_num[1] = once_num[2] = 0;
+	once_budget = 1LL<<28;
+	algo_apply = algo_delta = algo_grad = AUTO;
+	is_backward = false;
+	partition = UNIT;
+	map_beg = 0; map_end = num_map;
+	is_part_stale = true;
+	fft_apply_P = fft_apply_Q = fft_delta_P = fft_delta_Q = 0;
 	
 	this->prev_num_map = prev_num_map;
 	this->prev_num_unit = prev_num_unit;
@@ -71,7 +274,11 @@ Convolutional::Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
 	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
 	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
 
-	this->m = m; this->n = n; this->stride = stride; this->pad = m/2;
+	this->m = m; this->n = n; this->stride = stride;
+	this->groups = groups;
+	this->dilation_y = dilation_y; this->dilation_x = dilation_x;
+	this->pad_top = pad_top; this->pad_bottom = pad_bottom;
+	this->pad_left = pad_left; this->pad_right = pad_right;
 
 	int rank = 0;
 #ifdef USE_MPI
@@ -80,33 +287,38 @@ Convolutional::Convolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
 	if( num_unit%ldu != 0 )
 		if( rank == 0 ){
 			printf("WARNING : Wrong leading dimension of output on Convolution layer.\n");
-			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
 		}
 	if( prev_num_unit%prev_ldu != 0 )
 		if( rank == 0 ){
 			printf("WARNING : Wrong leading dimension of input on Convolution layer.\n");
-			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
 		}
-	if( ldu != (prev_ldu + 2*pad - n)/stride + 1 )
+	if( ldu != (prev_ldu + pad_left + pad_right - (n - 1)*dilation_x - 1)/stride + 1 )
 		if( rank == 0 ){
 			printf("WARNING : Wrong output image width on Convolution layer.\n");
-			printf("          Estimate width = %d.\n", (prev_ldu + 2*pad - n)/stride + 1);
-			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+			printf("          Estimate width = %d.\n", (prev_ldu + pad_left + pad_right - (n - 1)*dilation_x - 1)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
 		}
-	if( num_unit/ldu != (prev_num_unit/prev_ldu + 2*pad - m)/stride + 1 )
+	if( num_unit/ldu != (prev_num_unit/prev_ldu + pad_top + pad_bottom - (m - 1)*dilation_y - 1)/stride + 1 )
 		if( rank == 0 ){
 			printf("WARNING : Wrong output image height on Convolution layer.\n");
-			printf("          Estimate height = %d.\n", (prev_num_unit/prev_ldu + 2*pad - m)/stride + 1);
-			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+			printf("          Estimate height = %d.\n", (prev_num_unit/prev_ldu + pad_top + pad_bottom - (m - 1)*dilation_y - 1)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
+		}
+	if( groups < 1 || prev_num_map%groups != 0 || num_map%groups != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Number of maps is not divisible by groups on Convolution layer.\n");
+			printf("          Layer details : number of input map %d, number of map %d, groups %d.\n", prev_num_map, num_map, groups);
 		}
 	
 	func = f;
 
 	beta_ = 1.0; gamma_ = 1.0;
 	for( int i = 0; i < num_map; ++i ){
-		W.emplace_back(prev_num_map);
+		W.emplace_back(prev_num_map/groups);
 #pragma omp parallel for    // @@@ add
-		for( int j = 0; j < prev_num_map; ++j ){
+		for( int j = 0; j < prev_num_map/groups; ++j ){
 			W[i][j] = Mat(this->m, this->n);
 		}
 	}
@@ -127,25 +339,77 @@ void Convolutional::init ( std::mt19937& mt )
 
 #endif
 
-	// calculate indices of feed forward
-	{
+	// indices of feed forward and back propagation are built on demand, 1x1
+	// filters need none of them.
+	feed_idx.clear(); delta_idx.clear();
+	delta_beg = delta_end = 0;
+	if( !is_pointwise() ){
 		int my_size, my_offset;
-		const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
-		const int gap = prev_ldu + 2*pad;
 #ifdef USE_MPI
-		my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
-		my_offset = rank*num_unit/nprocs;
+		my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
+		my_offset = rank*prev_num_unit/nprocs;
+#else
+		my_size = prev_num_unit; my_offset = 0;
+#endif
+
+		// output rows which use own input rows.
+		int oa = 0, ob = 0;
+		if( my_size != 0 ) fft_delta_rows(my_offset/prev_ldu, (my_offset + my_size - 1)/prev_ldu + 1, oa, ob);
+		delta_beg = oa*ldu; delta_end = std::max(oa, ob)*ldu;
+	}
+
+	//const double r = sqrt(6.0/(num_unit + prev_num_unit));
+	//std::normal_distribution<double> d_rand(0.0, 1.0E-1);
+
+	//std::normal_distribution<double> d_rand(0.0, 0.01);
+	//std::normal_distribution<double> d_rand(0.0, 0.001);
+
+	double up = 0.1;
+	double low = 0.0;
+	if (!this->initial_value_range_default)
+	{
+		low = this->initial_value_range[0];
+		up  = this->initial_value_range[1];
+	}
+	std::normal_distribution<double> d_rand(low, up);
+
+	bias = Vec(num_map, 0.0); d_bias = Vec(num_map, 0.0);
+	this->r = Vec(num_map, 0.0); v = Vec(num_map, 0.0);
+	for( int i = 0; i < num_map; ++i ){
+		for( int j = 0; j < W[i].size(); ++j ){
+			for( int k = 0; k < W[i][j].m; ++k )
+#pragma omp parallel for    // @@@ add
+				for( int l = 0; l < W[i][j].n; ++l )	//@@W[i][j].m -> W[i][j].n
+					W[i][j](k,l) = d_rand(mt);
+		}				
+	}
+
+	for( int i = 0; i < num_map; ++i ) bias[i] = d_rand(mt);
+	clear_kernel();
+}
+
+void Convolutional::finalize ()
+{
+}
+
+const int* Convolutional::get_feed_idx ()
+{
+	int my_size, my_offset;
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
 #else
-		my_size = num_unit; my_offset = 0;
+	my_size = num_unit; my_offset = 0;
 #endif
-		feed_idx.resize(my_size*m*n);
+	if( feed_idx.size() != (long long)my_size*m*n ){
+		feed_idx.resize((long long)my_size*m*n);
 #pragma omp parallel for
 		for( int i = 0; i < my_size; ++i ){
 			int x = (i + my_offset)%ldu, y = (i + my_offset)/ldu;
 			for( int s = 0; s < n; ++s )
 				for( int t = 0; t < m; ++t ){
-					int idx = stride*x + s + t*gap + stride*y*gap;
-					int nx = idx%gap - pad, ny = idx/gap - pad;
+					int nx = stride*x + s*dilation_x - pad_left, ny = stride*y + t*dilation_y - pad_top;
 
 					if( nx < 0 || nx >= X || ny < 0 || ny >= Y ){
 						feed_idx[i*m*n + t*n + s] = -1;
@@ -156,34 +420,29 @@ void Convolutional::init ( std::mt19937& mt )
 		}
 	}
 
-	{
-		int my_size, my_offset;
-#ifdef USE_MPI
-		my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
-		my_offset = rank*prev_num_unit/nprocs;
-#else
-		my_size = prev_num_unit; my_offset = 0;
-#endif
+	return (feed_idx.empty() ? NULL : &feed_idx[0]);
+}
 
-		const int X = prev_ldu, Y = prev_num_unit/prev_ldu;
-		const int gap = prev_ldu + 2*pad;
+const int* Convolutional::get_delta_idx ()
+{
+	int my_size, my_offset;
 #ifdef USE_MPI
-		const int tmp_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs; 
-		const int tmp_offset = rank*num_unit/nprocs;
+	my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
+	my_offset = rank*prev_num_unit/nprocs;
 #else
-		const int tmp_size = num_unit;
-		const int tmp_offset = 0;
+	my_size = prev_num_unit; my_offset = 0;
 #endif
-		int l_idx = std::max(0, tmp_offset - m*prev_ldu/2);
-		int r_idx = std::min(num_unit, tmp_offset + tmp_size + m*prev_ldu/2);
-		delta_idx.resize(m*n*(r_idx - l_idx));
+
+	const int X = prev_ldu, Y = prev_num_unit/prev_ldu;
+	const int l_idx = delta_beg, r_idx = delta_end;
+	if( delta_idx.size() != (long long)m*n*(r_idx - l_idx) ){
+		delta_idx.resize((long long)m*n*(r_idx - l_idx));
 #pragma omp parallel for
 		for( int j = l_idx; j < r_idx; ++j ){
 			int x = j%ldu, y = j/ldu;
 			for( int t = 0; t < m; ++t )
 				for( int s = 0; s < n; ++s ){
-					int idx = stride*x + s + t*gap + stride*y*gap;
-					int nx = idx%gap - pad, ny = idx/gap - pad;
+					int nx = stride*x + s*dilation_x - pad_left, ny = stride*y + t*dilation_y - pad_top;
 
 					if( nx < 0 || nx >= X || ny < 0 || ny >= Y ){
 						delta_idx[(j-l_idx)*m*n + t*n + s] = -1;
@@ -198,305 +457,1570 @@ void Convolutional::init ( std::mt19937& mt )
 		}
 	}
 
-	//const double r = sqrt(6.0/(num_unit + prev_num_unit));
-	//std::normal_distribution<double> d_rand(0.0, 1.0E-1);
+	return (delta_idx.empty() ? NULL : &delta_idx[0]);
+}
 
-	//std::normal_distribution<double> d_rand(0.0, 0.01);
-	//std::normal_distribution<double> d_rand(0.0, 0.001);
+// The output units are taken by runs along their rows, and the tap q = t*n + s
+// of a run reads one input row as base + stride*x for the columns x of the run.
+// This is the smallest x with base + stride*x >= v.
+int Convolutional::run_begin ( const int base, const int stride, const int v )
+{
+	const int d = v - base;
+	return (d <= 0 ? -((-d)/stride) : (d + stride - 1)/stride);
+}
 
-	double up = 0.1;
-	double low = 0.0;
-	if (!this->initial_value_range_default)
-	{
-		low = this->initial_value_range[0];
-		up  = this->initial_value_range[1];
+// im2col of the tap q of the output units [j0, j0 + nt) for the samples
+// [i, i + size), the block of a unit in x is size doubles. A run of stride 1
+// over the whole mini-batch is one contiguous span of U, and the units out of
+// the image are filled with zero.
+void Convolutional::im2col_runs ( const Mat& U, const int q, const int j0, const int nt, const int i, const int size, double* x ) const
+{
+	const int X = prev_ldu, Y = prev_num_unit/prev_ldu, B = U.n;
+	const int ty = q/n, tx = q%n, off = tx*dilation_x - pad_left;
+	for( int j = j0; j < j0 + nt; ){
+		const int y = j/ldu, x0 = j%ldu, len = std::min(ldu - x0, j0 + nt - j);
+		const int ny = stride*y + ty*dilation_y - pad_top;
+		double* dst = x + (long long)(j - j0)*size;
+		int xa = x0, xb = x0;
+		if( 0 <= ny && ny < Y ){
+			xa = std::min(x0 + len, std::max(x0, run_begin(ny*X + off, stride, ny*X)));
+			xb = std::max(xa, std::min(x0 + len, run_begin(ny*X + off, stride, ny*X + X)));
+		}
+
+		std::fill(dst, dst + (long long)(xa - x0)*size, 0.0);
+		if( xa < xb ){
+			const double* src = &U(ny*X + stride*xa + off, i);
+			if( stride == 1 && size == B ) std::copy(src, src + (long long)(xb - xa)*B, dst + (long long)(xa - x0)*size);
+			else
+				for( int k = 0; k < xb - xa; ++k )
+					std::copy(src + (long long)k*stride*B, src + (long long)k*stride*B + size, dst + (long long)(xa - x0 + k)*size);
+		}
+		std::fill(dst + (long long)(xb - x0)*size, dst + (long long)len*size, 0.0);
+		j += len;
 	}
-	std::normal_distribution<double> d_rand(low, up);
+}
 
-	bias = Vec(num_map, 0.0); d_bias = Vec(num_map, 0.0);
-	this->r = Vec(num_map, 0.0); v = Vec(num_map, 0.0);
-	for( int i = 0; i < num_map; ++i ){
-		for( int j = 0; j < prev_num_map; ++j ){
-			for( int k = 0; k < W[i][j].m; ++k )
-#pragma omp parallel for    // @@@ add
-				for( int l = 0; l < W[i][j].n; ++l )	//@@W[i][j].m -> W[i][j].n
-					W[i][j](k,l) = d_rand(mt);
-		}				
+// col2im of the tap q, adding x of the output units [j0, j0 + nt) to the units
+// [lo, hi) of V for the samples [i, i + size).
+void Convolutional::col2im_runs ( const double* x, const int q, const int j0, const int nt, const int i, const int size,
+								  Mat& V, const int lo, const int hi ) const
+{
+	const int X = prev_ldu, Y = prev_num_unit/prev_ldu, B = V.n;
+	const int ty = q/n, tx = q%n, off = tx*dilation_x - pad_left;
+	for( int j = j0; j < j0 + nt; ){
+		const int y = j/ldu, x0 = j%ldu, len = std::min(ldu - x0, j0 + nt - j);
+		const int ny = stride*y + ty*dilation_y - pad_top;
+		j += len;
+		if( ny < 0 || ny >= Y ) continue;
+
+		const int xa = std::min(x0 + len, std::max(x0, run_begin(ny*X + off, stride, std::max(lo, ny*X))));
+		const int xb = std::min(x0 + len, run_begin(ny*X + off, stride, std::min(hi, ny*X + X)));
+		if( xa >= xb ) continue;
+		const double* src = x + (long long)(j - len - j0 + xa - x0)*size;
+		double* dst = &V(ny*X + stride*xa + off, i);
+		if( stride == 1 && size == B ){
+			for( long long k = 0; k < (long long)(xb - xa)*B; ++k ) dst[k] += src[k];
+		}
+		else
+			for( int k = 0; k < xb - xa; ++k )
+				for( int l = 0; l < size; ++l ) dst[(long long)k*stride*B + l] += src[(long long)k*size + l];
 	}
+}
 
-	for( int i = 0; i < num_map; ++i ) bias[i] = d_rand(mt);
+void Convolutional::build_kernel ( const bool is_delta )
+{
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( !is_delta ){
+		// rows follow the columns of im2col, which run over the input maps of a
+		// group inside each filter element for the interleaved layout. Columns
+		// are the output maps of the group of the row.
+		kernel_apply = Mat(m*n*prev_num_map, Og);
+#pragma omp parallel for
+		for( int j = 0; j < prev_num_map; ++j ){
+			const int g = j/Cg, jl = j%Cg;
+			for( int l = 0; l < n; ++l )
+				for( int k = 0; k < m; ++ k )
+					for( int i = 0; i < Og; ++i )
+						kernel_apply(is_interleaved ? g*(m*n*Cg) + (l*n + k)*Cg + jl : j*(m*n) + l*n + k, i) = W[g*Og + i][jl](k, l);
+		}
+	}
+	else{
+		// columns are the input maps of the group of the row.
+		kernel_delta = Mat(m*n*num_map, Cg);
+#pragma omp parallel for
+		for( int i = 0; i < num_map; ++i )
+			for( int l = 0; l < n; ++l )
+				for( int k = 0; k < m; ++ k )
+					for( int j = 0; j < Cg; ++j )
+						kernel_delta(i*(m*n) + l*n + k, j) = W[i][j](k, l);
+	}
 }
 
-void Convolutional::finalize ()
+void Convolutional::clear_kernel ()
 {
+	is_part_stale = true;
+	kernel_apply = kernel_delta = Mat();
+	wino_apply = wino_delta = Mat();
+	fft_apply.clear(); fft_delta.clear();
 }
 
-std::vector<std::vector<Convolutional::Mat>> Convolutional::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+// pass is 0 for apply, 1 for calc_delta and 2 for calc_gradient.
+// The direct kernels are used for small filters while the GEMM of im2col stays
+// skinny, that is while few maps are connected. Without BLAS the GEMM is a plain
+// loop and the direct kernels are always faster for small filters.
+// Winograd serves apply and calc_delta of 3x3 filters with stride 1 once enough
+// maps are connected to amortize the transforms, otherwise it falls back to AUTO.
+// Winograd and FFT transform the filters of all maps with dense taps, so grouped
+// and dilated layers fall back to AUTO from them as well.
+Convolutional::Algorithm Convolutional::choose_algorithm ( const Algorithm& algo, const int& pass ) const
 {
-	auto tot_beg = std::chrono::system_clock::now();
-	auto beg = tot_beg;
+	// the interleaved layout is computed only by im2col.
+	if( is_interleaved ) return IM2COL;
 
-	int offset = 0, my_size = U[0].m;
-#ifdef USE_MPI
-	offset = rank*my_size/nprocs;
-	my_size = (rank+1)*my_size/nprocs - rank*my_size/nprocs;
+	if( algo == WINOGRAD_2X2 || algo == WINOGRAD_4X4 )
+		return (pass != 2 && is_winograd_supported() ? algo : choose_algorithm(AUTO, pass));
+	const bool is_dense = (groups == 1 && dilation_y == 1 && dilation_x == 1);
+	if( algo == FFT && !is_dense ) return choose_algorithm(AUTO, pass);
+	if( algo != AUTO ) return algo;
+
+	if( pass != 2 && is_winograd_supported() && prev_num_map*num_map >= 128 )
+		return (ldu >= 8 && num_unit/ldu >= 8 ? WINOGRAD_4X4 : WINOGRAD_2X2);
+
+	if( is_dense && m*n > 9 && 2.0*fft_cost(pass) < 2.0*m*n*prev_num_map*num_map*num_unit ) return FFT;
+
+#if defined(USE_BLAS) || defined(USE_EIGEN)
+	if( m*n <= 49 && prev_num_map/groups*num_map <= 512 ) return DIRECT;
+#else
+	if( m*n <= 49 ) return DIRECT;
 #endif
 
-	std::vector<std::vector<Mat>> nabla(num_map);
-	for( int i = 0; i < num_map; ++i ){
-		nabla[i] = std::vector<Mat>(prev_num_map);
-#pragma omp parallel for    // @@@ add
-		for( int j = 0; j < prev_num_map; ++j )
-			nabla[i][j] = Mat(W[i][j].m, W[i][j].n);
+	return IM2COL;
+}
+
+long long Convolutional::cache_size ()
+{
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+	const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if( size > 0 ) return size;
+#endif
+	return 1LL<<20;
+}
+
+// Candidates are 1, the number of samples whose buffers fit in the cache, 4
+// times of it and the most that fit in once_budget. Each of them is used for
+// one batch and the one with the least time per sample is kept. The limit of
+// the workspace may be lowered after that, so every result is bounded by it.
+int Convolutional::get_once_num ( const int pass, const int rows, const int B )
+{
+	const long long bytes = sizeof(double)*std::max(1LL, (long long)rows*(m*n*prev_num_map + num_map));
+	const int lim = (int)std::max(1LL, std::min((long long)B, workspace->get_limit()/bytes));
+	if( once_num[pass] > 0 ) return std::min(once_num[pass], lim);
+
+	if( once_cand[pass].empty() ){
+		const int cap = (int)std::max(1LL, std::min((long long)B, std::min(once_budget, workspace->get_limit())/bytes));
+		const int fit = (int)std::max(1LL, std::min((long long)cap, cache_size()/bytes));
+		const int cand[] = { 1, fit, std::min(cap, 4*fit), cap };
+		for( int i = 0; i < 4; ++i )
+			if( once_cand[pass].empty() || once_cand[pass].back() < cand[i] ) once_cand[pass].push_back(cand[i]);
+		once_time[pass].clear();
 	}
 
-	std::vector<Mat> U_(prev_num_map);
-	for( int i = 0; i < prev_num_map; ++i )
-		U_[i] = (*prev_func)(U[i], false);
-	auto end = std::chrono::system_clock::now();
-	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	return std::min(once_cand[pass][once_time[pass].size()], lim);
+}
 
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
-	const int Y_ = num_unit/ldu, X_ = ldu;
-	Mat nabla_mat = Mat::zeros(m*n*num_map, prev_num_map);
+void Convolutional::set_once_time ( const int pass, const double t )
+{
+	if( once_num[pass] > 0 ) return;
 
-	Mat delta_mat(m*n*num_map, once_num*my_size), U_mat(once_num*my_size, prev_num_map);
-	for( int i = 0; i < delta[0].n; i += once_num ){
-		int size = std::min(once_num, delta[0].n - i);
-		auto beg = std::chrono::system_clock::now();
+	once_time[pass].push_back(t);
+	if( once_time[pass].size() < once_cand[pass].size() ) return;
 
-#pragma omp parallel for
-		for( int j = 0; j < m*n*num_map; ++j )
-			for( int k = 0; k < once_num*my_size; ++k )
-				delta_mat(j, k) = 0.0;
+	const int best = std::min_element(once_time[pass].begin(), once_time[pass].end()) - once_time[pass].begin();
+	once_num[pass] = once_cand[pass][best];
 
-		const int gap = prev_ldu + 2*pad;
+	int rank = 0;
 #ifdef USE_MPI
-		const int tmp_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs; 
-		const int tmp_offset = rank*num_unit/nprocs;
-#else
-		const int tmp_size = num_unit;
-		const int tmp_offset = 0;
+	MPI_Comm_rank(inner_world, &rank);
 #endif
-		const int l_idx = std::max(0, tmp_offset - m*prev_ldu/2);
-		const int r_idx = std::min(num_unit, tmp_offset + tmp_size + m*prev_ldu/2);
-		
-#pragma omp parallel
-		{
-			for( int l = 0; l < size; ++l )
-#pragma omp for nowait
-				for( int k = 0; k < num_map; ++k )
-					for( int j = l_idx; j < r_idx; ++j )
-						for( int s = 0; s < n; ++s )
-							for( int t = 0; t < m; ++ t )
-								if( delta_idx[(j-l_idx)*m*n + t*n + s] != -1 )
-									delta_mat(k*m*n + s*m + t, delta_idx[(j-l_idx)*m*n + t*n + s] + l*my_size) = delta[k](j, l+i);
-
-			for( int l = 0; l < size; ++l )
-#pragma omp for nowait
-				for( int k = 0; k < my_size; ++k )
-					for( int j = 0; j < prev_num_map; ++j )
-						U_mat(l*my_size + k, j) = U_[j](offset + k, l+i);
-		}
-		auto end = std::chrono::system_clock::now();
-		t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-
-		beg = std::chrono::system_clock::now();
-		nabla_mat += delta_mat*U_mat;
-		end = std::chrono::system_clock::now();
-		t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	if( rank == 0 ){
+		const char* name[] = { "apply", "calc_delta", "calc_gradient" };
+		printf("Convolutional [%d maps -> %d maps, %d x %d] once_num of %s : %d (",
+			   prev_num_map, num_map, m, n, name[pass], once_num[pass]);
+		for( int i = 0; i < once_cand[pass].size(); ++i )
+			printf("%s%d : %.3E s", (i == 0 ? "" : ", "), once_cand[pass][i], once_time[pass][i]);
+		printf(")\n");
 	}
+	once_cand[pass].clear(); once_time[pass].clear();
+}
 
-	beg = std::chrono::system_clock::now();
-	double sum = 0.0;
-#pragma omp parallel
-	{
-		for( int i = 0; i < num_map; ++i ){
-			for( int j = 0; j < prev_num_map; ++j ){
-#pragma omp for nowait
-				for( int k = 0; k < m; ++k )
-					for( int l = 0; l < n; ++l )
-						nabla[i][j](k, l) = nabla_mat(i*m*n + k*n + l, j);
-			}
+// y[l][i] += w[l]*x[i] for l < no, the case of 4 rows shares every load of x.
+void Convolutional::axpy_block ( const int no, const int len, const double* w, const double* x, double* const* y )
+{
+	if( no == 4 ){
+		const double w0 = w[0], w1 = w[1], w2 = w[2], w3 = w[3];
+		double* y0 = y[0]; double* y1 = y[1]; double* y2 = y[2]; double* y3 = y[3];
+		for( int i = 0; i < len; ++i ){
+			const double v = x[i];
+			y0[i] += w0*v; y1[i] += w1*v; y2[i] += w2*v; y3[i] += w3*v;
+		}
+	}
+	else
+		for( int l = 0; l < no; ++l ){
+			const double w_ = w[l];
+			double* y_ = y[l];
+			for( int i = 0; i < len; ++i ) y_[i] += w_*x[i];
+		}
+}
 
-			if( is_use_bias ){
-				sum = 0.0;
-#pragma omp for nowait reduction(+:sum)
-				for( int k = 0; k < delta[i].m; ++k )
-					for( int j = 0; j < delta[i].n; ++j )
-						sum += delta[i](k, j);
+// y[l][i] += d[l][i]*x[i] for l < no, the case of 4 rows shares every load of x.
+void Convolutional::fma_block ( const int no, const int len, const double* const* d, const double* x, double* const* y )
+{
+	if( no == 4 ){
+		const double* d0 = d[0]; const double* d1 = d[1]; const double* d2 = d[2]; const double* d3 = d[3];
+		double* y0 = y[0]; double* y1 = y[1]; double* y2 = y[2]; double* y3 = y[3];
+		for( int i = 0; i < len; ++i ){
+			const double v = x[i];
+			y0[i] += d0[i]*v; y1[i] += d1[i]*v; y2[i] += d2[i]*v; y3[i] += d3[i]*v;
+		}
+	}
+	else
+		for( int l = 0; l < no; ++l ){
+			const double* d_ = d[l];
+			double* y_ = y[l];
+			for( int i = 0; i < len; ++i ) y_[i] += d_[i]*x[i];
+		}
+}
 
-				d_bias[i] = sum;
+// y[l][i] += sum_k w[k*ldw + l]*x[k][i] for l < no and k < nk. For 4 rows of y,
+// 4 rows of x are added at once so that y is loaded and stored once for them.
+void Convolutional::gemm_block ( const int no, const int nk, const int len, const double* w, const int ldw,
+								 const double* const* x, double* const* y )
+{
+	int k = 0;
+	if( no == 4 ){
+		double* y0 = y[0]; double* y1 = y[1]; double* y2 = y[2]; double* y3 = y[3];
+		for( ; k + 4 <= nk; k += 4 ){
+			double a[16];
+			for( int p = 0; p < 4; ++p )
+				for( int l = 0; l < 4; ++l ) a[4*l + p] = w[(long long)(k + p)*ldw + l];
+			const double* x0 = x[k]; const double* x1 = x[k+1]; const double* x2 = x[k+2]; const double* x3 = x[k+3];
+			for( int i = 0; i < len; ++i ){
+				const double v0 = x0[i], v1 = x1[i], v2 = x2[i], v3 = x3[i];
+				y0[i] += a[0]*v0 + a[1]*v1 + a[2]*v2 + a[3]*v3;
+				y1[i] += a[4]*v0 + a[5]*v1 + a[6]*v2 + a[7]*v3;
+				y2[i] += a[8]*v0 + a[9]*v1 + a[10]*v2 + a[11]*v3;
+				y3[i] += a[12]*v0 + a[13]*v1 + a[14]*v2 + a[15]*v3;
 			}
 		}
 	}
-	end = std::chrono::system_clock::now();
-	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-	
-	beg = std::chrono::system_clock::now();
-#ifdef USE_MPI
-	std::vector<MPI_Request> req(num_map*prev_num_map);
-	for( int i = 0; i < num_map; ++i )
-		for( int j = 0; j < prev_num_map; ++j )
-			MPI_Allreduce(MPI_IN_PLACE, &nabla[i][j](0,0), m*n, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
-#endif
-	end = std::chrono::system_clock::now();
-	t_grad_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	for( ; k < nk; ++k ) axpy_block(no, len, w + (long long)k*ldw, x[k], y);
+}
 
-	end = std::chrono::system_clock::now();
-	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+bool Convolutional::is_pointwise () const
+{
+	return m == 1 && n == 1 && stride == 1 && pad_top == 0 && pad_bottom == 0 && pad_left == 0 && pad_right == 0 &&
+		ldu == prev_ldu && num_unit == prev_num_unit;
+}
 
-	return nabla;				
+bool Convolutional::is_winograd_supported () const
+{
+	return m == 3 && n == 3 && stride == 1 && pad_top == 1 && pad_left == 1 &&
+		ldu == prev_ldu && num_unit == prev_num_unit && groups == 1 && dilation_y == 1 && dilation_x == 1;
 }
 
-std::vector<Convolutional::Mat> Convolutional::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+// Transform matrices of F(2x2,3x3) and F(4x4,3x3), B^T and A^T are stored by rows.
+void Convolutional::winograd_matrix ( const int tile, const double*& BT, const double*& G, const double*& AT )
 {
-	auto tot_beg = std::chrono::system_clock::now();
-	auto beg = tot_beg;
+	static const double BT2[] = {
+		1.0,  0.0, -1.0,  0.0,
+		0.0,  1.0,  1.0,  0.0,
+		0.0, -1.0,  1.0,  0.0,
+		0.0,  1.0,  0.0, -1.0
+	};
+	static const double G2[] = {
+		1.0,  0.0, 0.0,
+		0.5,  0.5, 0.5,
+		0.5, -0.5, 0.5,
+		0.0,  0.0, 1.0
+	};
+	static const double AT2[] = {
+		1.0, 1.0,  1.0,  0.0,
+		0.0, 1.0, -1.0, -1.0
+	};
+	static const double BT4[] = {
+		4.0,  0.0, -5.0,  0.0, 1.0, 0.0,
+		0.0, -4.0, -4.0,  1.0, 1.0, 0.0,
+		0.0,  4.0, -4.0, -1.0, 1.0, 0.0,
+		0.0, -2.0, -1.0,  2.0, 1.0, 0.0,
+		0.0,  2.0, -1.0, -2.0, 1.0, 0.0,
+		0.0,  4.0,  0.0, -5.0, 0.0, 1.0
+	};
+	static const double G4[] = {
+		 1.0/4.0,       0.0,      0.0,
+		-1.0/6.0, -1.0/6.0, -1.0/6.0,
+		-1.0/6.0,  1.0/6.0, -1.0/6.0,
+		1.0/24.0, 1.0/12.0,  1.0/6.0,
+		1.0/24.0, -1.0/12.0, 1.0/6.0,
+		     0.0,       0.0,      1.0
+	};
+	static const double AT4[] = {
+		1.0, 1.0,  1.0, 1.0,  1.0, 0.0,
+		0.0, 1.0, -1.0, 2.0, -2.0, 0.0,
+		0.0, 1.0,  1.0, 4.0,  4.0, 0.0,
+		0.0, 1.0, -1.0, 8.0, -8.0, 1.0
+	};
+
+	if( tile == 2 ){ BT = BT2; G = G2; AT = AT2; }
+	else{ BT = BT4; G = G4; AT = AT4; }
+}
 
-	int my_size = prev_num_unit, my_offset = 0;
-#ifdef USE_MPI
-	std::vector<int> size(nprocs), offset(nprocs);
-	for( int i = 0; i < nprocs; ++i ){
-		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*prev_num_map;
-		offset[i] = i*prev_num_unit/nprocs*prev_num_map;
-	}
+// filter((i*a + j)*no + o, c) = (G g G^T)(i,j) for the filter g from the input
+// map c to the output map o. The filter of calc_delta is flipped and maps are swapped.
+void Convolutional::winograd_filter ( const int tile, const bool is_delta, Mat& filter ) const
+{
+	const double *BT, *G, *AT;
+	winograd_matrix(tile, BT, G, AT);
 
-	my_offset = offset[rank] / prev_num_map;
-	my_size = size[rank] / prev_num_map;
-#endif
+	const int a = tile + 2;
+	const int no = (is_delta ? prev_num_map : num_map), ni = (is_delta ? num_map : prev_num_map);
+	filter = Mat(a*a*no, ni);
+#pragma omp parallel for
+	for( int o = 0; o < no; ++o )
+		for( int c = 0; c < ni; ++c ){
+			double g[3][3], tmp[6][3];
+			for( int t = 0; t < 3; ++t )
+				for( int s = 0; s < 3; ++s )
+					g[t][s] = (is_delta ? W[c][o](2-s, 2-t) : W[o][c](s, t));
+
+			for( int i = 0; i < a; ++i )
+				for( int s = 0; s < 3; ++s )
+					tmp[i][s] = G[i*3]*g[0][s] + G[i*3+1]*g[1][s] + G[i*3+2]*g[2][s];
+			for( int i = 0; i < a; ++i )
+				for( int j = 0; j < a; ++j )
+					filter((i*a + j)*no + o, c) = tmp[i][0]*G[j*3] + tmp[i][1]*G[j*3+1] + tmp[i][2]*G[j*3+2];
+		}
+}
 
-	const int X = prev_ldu, Y = prev_num_unit/prev_ldu;
-	const int X_ = ldu, Y_ = num_unit/ldu;
+// Winograd convolution F(tile x tile, 3x3) of stride 1 and padding 1 for the
+// units [my_offset, my_offset + my_size) of out. Tiles are processed by chunks of
+// tile rows, every chunk is transformed by B^T d B, multiplied by the filters
+// with one GEMM per point of the transform and transformed back by A^T M A.
+void Convolutional::winograd ( const int tile, const Mat& filter, const std::vector<Mat>& in, std::vector<Mat>& out,
+							   const int my_offset, const int my_size, double& t_repl, double& t_gemm )
+{
+	if( my_size == 0 ) return;
 
-	Mat kernel(m*n*num_map, prev_num_map);
-#pragma omp parallel for
-	for( int i = 0; i < num_map; ++i )
-		for( int l = 0; l < n; ++l )
-			for( int k = 0; k < m; ++ k )
-				for( int j = 0; j < prev_num_map; ++j )
-					kernel(i*(m*n) + l*n + k, j) = W[i][j](k, l);
-	auto end = std::chrono::system_clock::now();
-	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	const double *BT, *G, *AT;
+	winograd_matrix(tile, BT, G, AT);
 
-	Mat input_image(my_size*once_num, m*n*num_map);
-	std::vector<Mat> tmp_img(delta[0].n/once_num + 1);
-	for( int i = 0; i < delta[0].n; i += once_num ){
-		int size = std::min(once_num, delta[0].n - i);
-		auto beg = std::chrono::system_clock::now();
+	const int a = tile + 2, ni = in.size(), no = out.size(), B = in[0].n;
+	const int Y = num_unit/ldu, X = ldu, TX = (X + tile - 1)/tile;
+	const int ty_beg = my_offset/X/tile, ty_end = (my_offset + my_size - 1)/X/tile + 1;
+	int nnz_BT = 0, nnz_AT = 0;
+	for( int i = 0; i < a*a; ++i ) nnz_BT += (BT[i] != 0.0);
+	for( int i = 0; i < tile*a; ++i ) nnz_AT += (AT[i] != 0.0);
 
-#pragma omp parallel for
-		for( int j = 0; j < my_size*once_num; ++j )
-			for( int k = 0; k < m*n*num_map; ++k )
-				input_image(j, k) = 0.0;
-		
-			const int gap = prev_ldu + 2*pad;
-#ifdef USE_MPI
-			const int tmp_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs; 
-			const int tmp_offset = rank*num_unit/nprocs;
-#else
-			const int tmp_size = num_unit;
-			const int tmp_offset = 0;
-#endif
-			int l_idx = std::max(0, tmp_offset - m*prev_ldu/2);
-			int r_idx = std::min(num_unit, tmp_offset + tmp_size + m*prev_ldu/2);
+	// chunks keep transformed images about 8MB or a half of the workspace.
+	const long long len = std::max(1LL, std::min(1LL<<20, workspace->get_limit()/16));
+	const int rows = (int)std::max(1LL, len/(a*a*std::max(ni, no)*TX*B));
+	const size_t max_ld = (size_t)std::min(rows, ty_end - ty_beg)*TX*B;
+	wino_in = workspace->get(0, a*a*ni*max_ld);
+	wino_out = workspace->get(1, a*a*no*max_ld);
+
+	for( int ty = ty_beg; ty < ty_end; ty += rows ){
+		const int nt = std::min(rows, ty_end - ty)*TX, ld = nt*B;
+
+		auto beg = std::chrono::system_clock::now();
 #pragma omp parallel
 		{
-			for( int l = 0; l < size; ++l )
-#pragma omp for nowait
-				for( int j = l_idx; j < r_idx; ++j )
-					for( int k = 0; k < num_map; ++k )
-						for( int s = 0; s < m*n; ++s )
-							if( delta_idx[(j-l_idx)*m*n + s] != -1 )
-								input_image(delta_idx[(j-l_idx)*m*n + s] + l*my_size, m*n*k + s) = delta[k](j, l+i);
+			std::vector<double> tmp(a*a*B);
+			const double* d[6][6];
+#pragma omp for
+			for( int it = 0; it < ni*nt; ++it ){
+				const int c = it/nt, q = it%nt;
+				const int y = (ty + q/TX)*tile - 1, x = (q%TX)*tile - 1;
+				for( int i = 0; i < a; ++i )
+					for( int j = 0; j < a; ++j ){
+						const int ny = y + i, nx = x + j;
+						d[i][j] = (0 <= ny && ny < Y && 0 <= nx && nx < X ? &in[c](ny*X + nx, 0) : NULL);
+					}
+
+				for( int i = 0; i < a; ++i )
+					for( int j = 0; j < a; ++j ){
+						double* t_ = &tmp[(i*a + j)*B];
+						std::fill(t_, t_ + B, 0.0);
+						for( int k = 0; k < a; ++k ){
+							const double w = BT[i*a + k];
+							if( w == 0.0 || d[k][j] == NULL ) continue;
+							for( int b = 0; b < B; ++b ) t_[b] += w*d[k][j][b];
+						}
+					}
+				for( int i = 0; i < a; ++i )
+					for( int j = 0; j < a; ++j ){
+						double* v = &wino_in[((size_t)(i*a + j)*ni + c)*ld + q*B];
+						std::fill(v, v + B, 0.0);
+						for( int k = 0; k < a; ++k ){
+							const double w = BT[j*a + k];
+							if( w == 0.0 ) continue;
+							const double* t_ = &tmp[(i*a + k)*B];
+							for( int b = 0; b < B; ++b ) v[b] += w*t_[b];
+						}
+					}
+			}
 		}
 		auto end = std::chrono::system_clock::now();
-		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		t_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
 		beg = std::chrono::system_clock::now();
-		tmp_img[i/once_num] = input_image * kernel;
+		for( int i = 0; i < a*a; ++i )
+			gemm(no, ld, ni, &filter(i*no, 0), ni, &wino_in[(size_t)i*ni*ld], ld, 0.0, &wino_out[(size_t)i*no*ld], ld);
 		end = std::chrono::system_clock::now();
-		t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-	}
+		t_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
-	std::vector<Mat> nx_delta(prev_num_map, Mat(prev_num_unit, delta[0].n));
-#ifdef USE_MPI
-	beg = std::chrono::system_clock::now();
-	double* buf = new double[delta[0].n*prev_num_unit*prev_num_map];
+		beg = std::chrono::system_clock::now();
+#pragma omp parallel
+		{
+			std::vector<double> tmp(tile*a*B);
+#pragma omp for
+			for( int it = 0; it < no*nt; ++it ){
+				const int o = it/nt, q = it%nt;
+				const int y = (ty + q/TX)*tile, x = (q%TX)*tile;
+
+				for( int r = 0; r < tile; ++r )
+					for( int j = 0; j < a; ++j ){
+						double* t_ = &tmp[(r*a + j)*B];
+						std::fill(t_, t_ + B, 0.0);
+						for( int i = 0; i < a; ++i ){
+							const double w = AT[r*a + i];
+							if( w == 0.0 ) continue;
+							const double* v = &wino_out[((size_t)(i*a + j)*no + o)*ld + q*B];
+							for( int b = 0; b < B; ++b ) t_[b] += w*v[b];
+						}
+					}
+				for( int r = 0; r < tile; ++r )
+					for( int s = 0; s < tile; ++s ){
+						const int idx = (y + r)*X + x + s;
+						if( y + r >= Y || x + s >= X || idx < my_offset || my_offset + my_size <= idx ) continue;
+
+						double* v = &out[o](idx, 0);
+						std::fill(v, v + B, 0.0);
+						for( int j = 0; j < a; ++j ){
+							const double w = AT[s*a + j];
+							if( w == 0.0 ) continue;
+							const double* t_ = &tmp[(r*a + j)*B];
+							for( int b = 0; b < B; ++b ) v[b] += w*t_[b];
+						}
+					}
+			}
+		}
+		end = std::chrono::system_clock::now();
+		t_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		cnt_flop += 2LL*nt*B*(2LL*ni*a*nnz_BT + (long long)no*(a + tile)*nnz_AT);
+	}
+}
+
+// Bands of FFT and their grid, the passes 0 and 2 take bands of output rows and
+// the pass 1 takes bands of input rows in [beg, end). The band is halved until
+// transforms of a sample fit in 2^22 doubles.
+void Convolutional::fft_plan ( const int pass, const int beg, const int end, int& rows, int& P, int& Q ) const
+{
+	const int X_ = ldu;
+	const long long maps = prev_num_map + num_map;
+
+	rows = std::max(1, end - beg);
+	while( true ){
+		if( pass != 1 ){
+			P = ::FFT::good_size((rows - 1)*stride + m);
+			Q = ::FFT::good_size((X_ - 1)*stride + n, true);
+		}
+		else{
+			// upsampled delta of the band has to be apart from the wrap of the filter.
+			int H = m;
+			for( int a = beg; a < end; a += rows ){
+				int oa, ob;
+				fft_delta_rows(a, std::min(end, a + rows), oa, ob);
+				if( oa < ob ) H = std::max(H, std::max((ob - oa - 1)*stride + m, std::min(end, a + rows) + pad_top - oa*stride));
+			}
+			P = ::FFT::good_size(H);
+			Q = ::FFT::good_size(std::max((X_ - 1)*stride + n, prev_ldu + pad_left), true);
+		}
+
+		if( rows == 1 || 2*maps*P*(Q/2 + 1) <= (1<<22) ) break;
+		rows = (rows + 1)/2;
+	}
+}
 
+// Output rows [oa, ob) used by the input rows [a, b).
+void Convolutional::fft_delta_rows ( const int a, const int b, int& oa, int& ob ) const
+{
+	const int num = a + pad_top - (m - 1)*dilation_y;
+	oa = (num <= 0 ? 0 : (num + stride - 1)/stride);
+	ob = std::min(num_unit/ldu, (b - 1 + pad_top)/stride + 1);
+}
+
+// Samples of the mini-batch transformed at once.
+int Convolutional::fft_chunk ( const int P, const int Q, const int B ) const
+{
+	const long long size = 2LL*(prev_num_map + num_map)*P*(Q/2 + 1);
+	return (int)std::max(1LL, std::min((long long)B, std::min(1LL<<22, workspace->get_limit()/8)/size));
+}
+
+// Flops of FFT for a sample, which are compared with 2*m*n*C*O*num_unit of im2col.
+double Convolutional::fft_cost ( const int pass ) const
+{
+	const int end = (pass == 1 ? prev_num_unit/prev_ldu : num_unit/ldu);
+	int rows, P, Q;
+	fft_plan(pass, 0, end, rows, P, Q);
+
+	const double N = (double)P*Q;
+	return (end + rows - 1)/rows*((prev_num_map + num_map)*2.5*N*log2(N) + 4.0*prev_num_map*num_map*N);
+}
+
+// filter(f, o, c) is the transform of the filter from the input map c to the output
+// map o, conjugated for the correlation of apply. Maps are swapped for calc_delta.
+void Convolutional::fft_filter ( const RealFFT2D& fft, const bool is_delta, std::vector<double>& filter ) const
+{
+	const int P = fft.rows(), Qh = fft.cols()/2 + 1, PQ = P*Qh;
+	const int no = (is_delta ? prev_num_map : num_map), ni = (is_delta ? num_map : prev_num_map);
+
+	filter.resize(2LL*PQ*no*ni);
 #pragma omp parallel
 	{
-		for( int i = 0; i < U[0].n; ++i )
-#pragma omp for nowait
+		std::vector<double> x(2*PQ), work(2*std::max(P, Qh));
+#pragma omp for
+		for( int it = 0; it < no*ni; ++it ){
+			const int o = it/ni, c = it%ni;
+			const Mat& w = (is_delta ? W[c][o] : W[o][c]);
+
+			std::fill(x.begin(), x.end(), 0.0);
+			for( int t = 0; t < m; ++t )
+				for( int s = 0; s < n; ++s )
+					x[2*(t*Qh + s/2) + s%2] = w(s, t);
+			fft.forward(&x[0], 1, &work[0]);
+
+			for( int f = 0; f < PQ; ++f ){
+				filter[2*((long long)f*no*ni + it)] = x[2*f];
+				filter[2*((long long)f*no*ni + it) + 1] = (is_delta ? x[2*f+1] : -x[2*f+1]);
+			}
+		}
+	}
+}
+
+// Transforms the rows [r0, r0 + H) of input maps padded by pad_left columns on the
+// left into fft_in for the samples [b0, b0 + bc).
+void Convolutional::fft_pack_input ( const RealFFT2D& fft, const std::vector<Mat>& U, const int r0, const int H, const int b0, const int bc )
+{
+	const int P = fft.rows(), Q = fft.cols(), Qh = Q/2 + 1, PQ = P*Qh, ld = 2*bc;
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+
+#pragma omp parallel
+	{
+		std::vector<double> work(2*std::max(P, Qh)*bc);
+#pragma omp for
+		for( int c = 0; c < prev_num_map; ++c ){
+			double* x = &fft_in[(long long)c*PQ*ld];
+			std::fill(x, x + (long long)PQ*ld, 0.0);
+			for( int i = 0; i < H; ++i ){
+				const int iy = r0 + i;
+				if( iy < 0 || iy >= Y ) continue;
+				for( int j = pad_left; j < std::min(Q, X + pad_left); ++j ){
+					const double* u = &U[c](iy*X + j - pad_left, b0);
+					double* v = x + ((long long)i*Qh + j/2)*ld + (j%2)*bc;
+					for( int b = 0; b < bc; ++b ) v[b] = u[b];
+				}
+			}
+			fft.forward(x, bc, &work[0]);
+		}
+	}
+}
+
+// out(o, f) = sum_c filter(f, o, c) in(c, f) on blocks of bc complex numbers.
+void Convolutional::fft_multiply ( const int PQ, const int no, const int ni, const double* filter, const double* in, double* out, const int bc )
+{
+	const int ld = 2*bc;
+#pragma omp parallel for
+	for( int f = 0; f < PQ; ++f )
+		for( int o = 0; o < no; ++o ){
+			double* y = out + ((long long)o*PQ + f)*ld;
+			std::fill(y, y + ld, 0.0);
+			for( int c = 0; c < ni; ++c ){
+				const double wr = filter[2*((long long)f*no*ni + o*ni + c)], wi = filter[2*((long long)f*no*ni + o*ni + c) + 1];
+				const double* x = in + ((long long)c*PQ + f)*ld;
+				for( int b = 0; b < bc; ++b ){
+					y[b] += wr*x[b] - wi*x[bc+b];
+					y[bc+b] += wr*x[bc+b] + wi*x[b];
+				}
+			}
+		}
+	cnt_flop += 8LL*PQ*no*ni*bc;
+}
+
+// FFT convolution by bands of output rows, every band of input is transformed,
+// multiplied by the conjugated filters and transformed back to the correlation.
+void Convolutional::apply_fft ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size )
+{
+	if( my_size == 0 ) return;
+
+	auto beg = std::chrono::system_clock::now();
+	const int X_ = ldu, B = U[0].n;
+	const int y_beg = my_offset/X_, y_end = (my_offset + my_size - 1)/X_ + 1;
+	int rows, P, Q;
+	fft_plan(0, y_beg, y_end, rows, P, Q);
+
+	const RealFFT2D fft(P, Q);
+	const int Qh = Q/2 + 1, PQ = P*Qh, Bc = fft_chunk(P, Q, B);
+	if( fft_apply.empty() || fft_apply_P != P || fft_apply_Q != Q ){
+		fft_filter(fft, false, fft_apply);
+		fft_apply_P = P; fft_apply_Q = Q;
+	}
+	fft_in = workspace->get(0, 2LL*prev_num_map*PQ*Bc);
+	fft_out = workspace->get(1, 2LL*num_map*PQ*Bc);
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	const double scale = 1.0/(P*(Q/2));
+	for( int y0 = y_beg; y0 < y_end; y0 += rows ){
+		const int y1 = std::min(y_end, y0 + rows);
+		for( int b0 = 0; b0 < B; b0 += Bc ){
+			const int bc = std::min(Bc, B - b0), ld = 2*bc;
+
+			beg = std::chrono::system_clock::now();
+			fft_pack_input(fft, U, y0*stride - pad_top, (y1 - y0 - 1)*stride + m, b0, bc);
+			end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			fft_multiply(PQ, num_map, prev_num_map, &fft_apply[0], &fft_in[0], &fft_out[0], bc);
+			end = std::chrono::system_clock::now();
+			t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel
+			{
+				std::vector<double> work(2*std::max(P, Qh)*bc);
+#pragma omp for
+				for( int o = 0; o < num_map; ++o ){
+					double* x = &fft_out[(long long)o*PQ*ld];
+					fft.inverse(x, bc, &work[0]);
+
+					for( int y = y0; y < y1; ++y )
+						for( int j = 0; j < X_; ++j ){
+							const int idx = y*X_ + j;
+							if( idx < my_offset || my_offset + my_size <= idx ) continue;
+
+							const double* v = x + ((long long)(y - y0)*stride*Qh + j*stride/2)*ld + (j*stride%2)*bc;
+							double* r = &ret[o](idx, b0);
+							for( int b = 0; b < bc; ++b ) r[b] = scale*v[b];
+						}
+				}
+			}
+			end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
+	}
+}
+
+// FFT transposed convolution by bands of input rows. The delta used by a band
+// is upsampled by stride, multiplied by the filters and transformed back.
+void Convolutional::calc_delta_fft ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size )
+{
+	if( my_size == 0 ) return;
+
+	auto beg = std::chrono::system_clock::now();
+	const int X_ = ldu, X = prev_ldu, B = delta[0].n;
+	const int a_beg = my_offset/X, a_end = (my_offset + my_size - 1)/X + 1;
+	int rows, P, Q;
+	fft_plan(1, a_beg, a_end, rows, P, Q);
+
+	const RealFFT2D fft(P, Q);
+	const int Qh = Q/2 + 1, PQ = P*Qh, Bc = fft_chunk(P, Q, B);
+	if( fft_delta.empty() || fft_delta_P != P || fft_delta_Q != Q ){
+		fft_filter(fft, true, fft_delta);
+		fft_delta_P = P; fft_delta_Q = Q;
+	}
+	fft_in = workspace->get(0, 2LL*num_map*PQ*Bc);
+	fft_out = workspace->get(1, 2LL*prev_num_map*PQ*Bc);
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	const double scale = 1.0/(P*(Q/2));
+	for( int a0 = a_beg; a0 < a_end; a0 += rows ){
+		const int a1 = std::min(a_end, a0 + rows);
+		int oa, ob;
+		fft_delta_rows(a0, a1, oa, ob);
+
+		for( int b0 = 0; b0 < B; b0 += Bc ){
+			const int bc = std::min(Bc, B - b0), ld = 2*bc;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel
+			{
+				std::vector<double> work(2*std::max(P, Qh)*bc);
+#pragma omp for
+				for( int o = 0; o < num_map; ++o ){
+					double* x = &fft_in[(long long)o*PQ*ld];
+					std::fill(x, x + (long long)PQ*ld, 0.0);
+					for( int y = oa; y < ob; ++y )
+						for( int j = 0; j < X_; ++j ){
+							const double* d = &delta[o](y*X_ + j, b0);
+							double* v = x + ((long long)(y - oa)*stride*Qh + j*stride/2)*ld + (j*stride%2)*bc;
+							for( int b = 0; b < bc; ++b ) v[b] = d[b];
+						}
+					fft.forward(x, bc, &work[0]);
+				}
+			}
+			end = std::chrono::system_clock::now();
+			t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			fft_multiply(PQ, prev_num_map, num_map, &fft_delta[0], &fft_in[0], &fft_out[0], bc);
+			end = std::chrono::system_clock::now();
+			t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel
+			{
+				std::vector<double> work(2*std::max(P, Qh)*bc);
+#pragma omp for
+				for( int c = 0; c < prev_num_map; ++c ){
+					double* x = &fft_out[(long long)c*PQ*ld];
+					fft.inverse(x, bc, &work[0]);
+
+					for( int y = a0; y < a1; ++y )
+						for( int j = 0; j < X; ++j ){
+							const int idx = y*X + j, v_y = y + pad_top - oa*stride, v_x = j + pad_left;
+							if( idx < my_offset || my_offset + my_size <= idx ) continue;
+
+							double* r = &nx_delta[c](idx, b0);
+							if( oa >= ob || v_y < 0 ){
+								std::fill(r, r + bc, 0.0);
+								continue;
+							}
+							const double* v = x + ((long long)v_y*Qh + v_x/2)*ld + (v_x%2)*bc;
+							for( int b = 0; b < bc; ++b ) r[b] = scale*v[b];
+						}
+				}
+			}
+			end = std::chrono::system_clock::now();
+			t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
+	}
+}
+
+// FFT correlation of input and upsampled delta by bands of output rows, the
+// products are summed over the mini-batch and bands in the frequency domain.
+void Convolutional::calc_gradient_fft ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+	if( my_size == 0 ){
+		for( int i = 0; i < num_map; ++i )
 			for( int j = 0; j < prev_num_map; ++j )
-				for( int k = 0; k < my_size; ++k )
-					buf[i*(prev_num_map*my_size) + j*my_size + k + offset[rank]*U[0].n] = tmp_img[i/once_num](k + (i%once_num)*my_size, j);
+				nabla[i][j] = Mat::zeros(W[i][j].m, W[i][j].n);
+		return;
 	}
 
-	std::vector<int> gath_size(nprocs), gath_displs(nprocs);
-	for( int i = 0; i < nprocs; ++i ){
-		gath_size[i] = size[i]*U[0].n;
-		gath_displs[i] = offset[i]*U[0].n;
+	auto beg = std::chrono::system_clock::now();
+	const int X_ = ldu, B = delta[0].n, no = num_map, ni = prev_num_map;
+	const int y_beg = my_offset/X_, y_end = (my_offset + my_size - 1)/X_ + 1;
+	int rows, P, Q;
+	fft_plan(2, y_beg, y_end, rows, P, Q);
+
+	const RealFFT2D fft(P, Q);
+	const int Qh = Q/2 + 1, PQ = P*Qh, Bc = fft_chunk(P, Q, B);
+	fft_in = workspace->get(0, 2LL*ni*PQ*Bc);
+	fft_out = workspace->get(1, 2LL*no*PQ*Bc);
+	double* acc = workspace->get(2, 2LL*PQ*no*ni);
+	std::fill(acc, acc + 2LL*PQ*no*ni, 0.0);
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	for( int y0 = y_beg; y0 < y_end; y0 += rows ){
+		const int y1 = std::min(y_end, y0 + rows);
+		for( int b0 = 0; b0 < B; b0 += Bc ){
+			const int bc = std::min(Bc, B - b0), ld = 2*bc;
+
+			beg = std::chrono::system_clock::now();
+			fft_pack_input(fft, U, y0*stride - pad_top, (y1 - y0 - 1)*stride + m, b0, bc);
+#pragma omp parallel
+			{
+				std::vector<double> work(2*std::max(P, Qh)*bc);
+#pragma omp for
+				for( int o = 0; o < no; ++o ){
+					double* x = &fft_out[(long long)o*PQ*ld];
+					std::fill(x, x + (long long)PQ*ld, 0.0);
+					for( int y = y0; y < y1; ++y )
+						for( int j = 0; j < X_; ++j ){
+							const int idx = y*X_ + j;
+							if( idx < my_offset || my_offset + my_size <= idx ) continue;
+
+							const double* d = &delta[o](idx, b0);
+							double* v = x + ((long long)(y - y0)*stride*Qh + j*stride/2)*ld + (j*stride%2)*bc;
+							for( int b = 0; b < bc; ++b ) v[b] = d[b];
+						}
+					fft.forward(x, bc, &work[0]);
+				}
+			}
+			end = std::chrono::system_clock::now();
+			t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int f = 0; f < PQ; ++f )
+				for( int o = 0; o < no; ++o ){
+					const double* d = &fft_out[((long long)o*PQ + f)*ld];
+					for( int c = 0; c < ni; ++c ){
+						const double* e = &fft_in[((long long)c*PQ + f)*ld];
+						double sr = 0.0, si = 0.0;
+						for( int b = 0; b < bc; ++b ){
+							sr += d[b]*e[b] + d[bc+b]*e[bc+b];
+							si += d[b]*e[bc+b] - d[bc+b]*e[b];
+						}
+						acc[2*((long long)f*no*ni + o*ni + c)] += sr;
+						acc[2*((long long)f*no*ni + o*ni + c) + 1] += si;
+					}
+				}
+			cnt_flop += 8LL*PQ*no*ni*bc;
+			end = std::chrono::system_clock::now();
+			t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
 	}
 
-	MPI_Request req;
-	MPI_Iallgatherv(MPI_IN_PLACE, gath_size[rank], MPI_DOUBLE_PRECISION,
-					buf, &gath_size[0], &gath_displs[0], MPI_DOUBLE_PRECISION, inner_world, &req);
+	beg = std::chrono::system_clock::now();
+	const double scale = 1.0/(P*(Q/2));
+#pragma omp parallel
+	{
+		std::vector<double> x(2*PQ), work(2*std::max(P, Qh));
+#pragma omp for
+		for( int it = 0; it < no*ni; ++it ){
+			for( int f = 0; f < PQ; ++f ){
+				x[2*f] = acc[2*((long long)f*no*ni + it)];
+				x[2*f+1] = acc[2*((long long)f*no*ni + it) + 1];
+			}
+			fft.inverse(&x[0], 1, &work[0]);
+
+			for( int t = 0; t < m; ++t )
+				for( int s = 0; s < n; ++s )
+					nabla[it/ni][it%ni](s, t) = scale*x[2*(t*Qh + s/2) + s%2];
+		}
+	}
 	end = std::chrono::system_clock::now();
-	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+std::vector<std::vector<Convolutional::Mat>> Convolutional::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	std::vector<std::vector<Mat>> nabla(num_map);
+	for( int i = 0; i < num_map; ++i ){
+		nabla[i] = std::vector<Mat>(W[i].size());
+#pragma omp parallel for    // @@@ add
+		for( int j = 0; j < W[i].size(); ++j )
+			nabla[i][j] = Mat(W[i][j].m, W[i][j].n);
+	}
+
+	std::vector<Mat> U_(U.size());
+	for( int i = 0; i < U.size(); ++i )
+		U_[i] = (*prev_func)(U[i], false);
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	const Algorithm algo = choose_algorithm(algo_grad, 2);
+#ifdef USE_MPI
+	if( is_map_split() )
+		calc_gradient_maps(U_, delta, nabla);
+	else
+#endif
+	if( is_backward ){
+		// own input units of calc_delta.
+		int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+		my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
+		my_offset = rank*prev_num_unit/nprocs;
+#endif
+		if( kernel_apply.m == 0 ) build_kernel(false);
+		backward_delta = std::vector<Mat>(prev_num_map, Mat(prev_num_unit, delta[0].n));
+		calc_backward_im2col(U_, delta, nabla, backward_delta, my_offset, my_size);
+	}
+	else if( is_pointwise() )
+		calc_gradient_pointwise(U_, delta, nabla);
+	else if( is_interleaved )
+		calc_gradient_interleaved(U_[0], delta[0], nabla);
+	else if( algo == DIRECT )
+		calc_gradient_direct(U_, delta, nabla);
+	else if( algo == FFT )
+		calc_gradient_fft(U_, delta, nabla);
+	else
+		calc_gradient_im2col(U_, delta, nabla);
 
 	beg = std::chrono::system_clock::now();
+	if( is_use_bias ){
+		// in the spatial decomposition own band is summed and reduced with nabla.
+		int row_beg = 0, row_end = num_unit;
+#ifdef USE_MPI
+		if( is_spatial ){
+			row_beg = rank*num_unit/nprocs;
+			row_end = (rank+1)*num_unit/nprocs;
+		}
+#endif
+		for( int i = 0; i < num_map; ++i ){
+			// a column of the interleaved delta is the map i.
+			const Mat& D = delta[is_interleaved ? 0 : i];
+			const int beg_col = (is_interleaved ? i : 0), end_col = (is_interleaved ? i + 1 : D.n);
+			const int k_beg = row_beg*(D.m/num_unit), k_end = row_end*(D.m/num_unit);
+			double sum = 0.0;
+#pragma omp parallel for reduction(+:sum)
+			for( int k = k_beg; k < k_end; ++k )
+				for( int j = beg_col; j < end_col; ++j )
+					sum += D(k, j);
+
+			d_bias[i] = sum;
+		}
+	}
+	end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	for( int i = 0; i < num_map; ++i )
+		for( int j = 0; j < W[i].size(); ++j )
+			MPI_Allreduce(MPI_IN_PLACE, &nabla[i][j](0,0), m*n, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+	if( is_use_bias && is_spatial )
+		MPI_Allreduce(MPI_IN_PLACE, &d_bias[0], num_map, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_grad_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	end = std::chrono::system_clock::now();
+	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nabla;				
+}
+
+// Correlation of input and delta by im2col, the image of own output units is
+// gathered as in apply_im2col and multiplied by delta of them. Every element of
+// both is written once, and the output units are taken in tiles which fit the
+// cache. Each group multiplies its own rows of the image by its own columns of
+// delta.
+void Convolutional::calc_gradient_im2col ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	const int mn = m*n, rows = mn*prev_num_map;
+	const int Cg = prev_num_map/groups, Og = num_map/groups, rows_g = mn*Cg;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	const int once_num = get_once_num(2, my_size, delta[0].n);
+	const int tile = (int)std::max(1LL, std::min((long long)my_size, std::min(cache_size(), workspace->get_limit())/(8LL*once_num*(rows + num_map))));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* nabla_mat = workspace->get(0, (long long)rows*Og);
+	double* input_image = workspace->get(1, (long long)rows*tile*once_num);
+	double* delta_mat = workspace->get(2, (long long)tile*once_num*num_map);
+	std::fill(nabla_mat, nabla_mat + (long long)rows*Og, 0.0);
+	for( int i = 0; i < delta[0].n; i += once_num ){
+		int size = std::min(once_num, delta[0].n - i);
+
+		for( int j0 = 0; j0 < my_size; j0 += tile ){
+			const int nt = std::min(tile, my_size - j0), ld = nt*size;
+			auto beg = std::chrono::system_clock::now();
 #pragma omp parallel
-	{
-		for( int j = 0; j < prev_num_map; ++j )
+			{
+#pragma omp for nowait
+				for( int r = 0; r < rows; ++r )
+					im2col_runs(U[r/mn], r%mn, my_offset + j0, nt, i, size, input_image + (long long)r*ld);
 #pragma omp for nowait
-			for( int k = 0; k < size[rank]/prev_num_map; ++k )
-				for( int i = 0; i < U[0].n; ++i )
-					nx_delta[j](offset[rank]/prev_num_map+k, i) = buf[i*size[rank]+j*size[rank]/prev_num_map+k + offset[rank]*U[0].n];
+				for( int j = 0; j < nt; ++j )
+					for( int l = 0; l < size; ++l )
+						for( int k = 0; k < num_map; ++k )
+							delta_mat[(long long)(j*size + l)*num_map + k] = delta[k](my_offset + j0 + j, i+l);
+			}
+			auto end = std::chrono::system_clock::now();
+			t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			for( int g = 0; g < groups; ++g )
+				gemm(rows_g, Og, ld, input_image + (long long)g*rows_g*ld, ld, delta_mat + g*Og, num_map,
+					 1.0, nabla_mat + (long long)g*rows_g*Og, Og);
+			end = std::chrono::system_clock::now();
+			t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
 	}
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(2, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/delta[0].n);
 
-	MPI_Status stat;
-	MPI_Wait(&req, &stat);
-	
+	auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i ){
+		const int g = i/Og;
+		for( int j = 0; j < Cg; ++j )
+			for( int s = 0; s < mn; ++s )
+				nabla[i][j](s%n, s/n) = nabla_mat[(long long)((g*Cg + j)*mn + s)*Og + i - g*Og];
+	}
+	auto end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// calc_gradient_im2col and calc_delta_im2col on one pass over the output units
+// they cover. A tile of delta is copied once as num_map rows, and the image of
+// the tile is multiplied by its transpose for the gradient while the kernel
+// multiplied by it is added to nx_delta by col2im. Under MPI the gradient takes
+// own output units and nx_delta those over own input units, each a run of
+// columns of the tile.
+void Convolutional::calc_backward_im2col ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla,
+										   std::vector<Mat>& nx_delta, const int my_offset, const int my_size )
+{
+	const int mn = m*n, rows = mn*prev_num_map, B = delta[0].n;
+	const int Cg = prev_num_map/groups, Og = num_map/groups, rows_g = mn*Cg;
+	int grad_beg = 0, grad_end = num_unit;
+#ifdef USE_MPI
+	grad_beg = rank*num_unit/nprocs;
+	grad_end = (rank+1)*num_unit/nprocs;
+#endif
+	const int lo = std::min(grad_beg, delta_beg), hi = std::max(grad_end, delta_end), len = std::max(0, hi - lo);
+
+#pragma omp parallel for
+	for( int c = 0; c < prev_num_map; ++c )
+		std::fill(&nx_delta[c](my_offset, 0), &nx_delta[c](my_offset, 0) + (long long)my_size*B, 0.0);
+
+	const int once_num = get_once_num(2, len, B);
+	const int tile = (int)std::max(1LL, std::min((long long)std::max(1, len), std::min(cache_size(), workspace->get_limit())/(8LL*once_num*(2*rows + num_map))));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* nabla_mat = workspace->get(0, (long long)rows*Og);
+	double* input_image = workspace->get(1, (long long)rows*tile*once_num);
+	double* delta_mat = workspace->get(2, (long long)num_map*tile*once_num);
+	double* col = workspace->get(3, (long long)rows*tile*once_num);
+	std::fill(nabla_mat, nabla_mat + (long long)rows*Og, 0.0);
+	for( int i = 0; i < B; i += once_num ){
+		const int size = std::min(once_num, B - i);
+
+		for( int j0 = lo; j0 < hi; j0 += tile ){
+			const int nt = std::min(tile, hi - j0), ld = nt*size;
+			// runs [ga, gb) and [da, db) of the tile for the gradient and nx_delta.
+			const int ga = std::max(0, grad_beg - j0), gb = std::max(ga, std::min(nt, grad_end - j0));
+			const int da = std::max(0, delta_beg - j0), db = std::max(da, std::min(nt, delta_end - j0));
+			auto beg = std::chrono::system_clock::now();
 #pragma omp parallel
-	{
-		for( int j = 0; j < prev_num_map; ++j )
-			for( int n = 0; n < nprocs; ++n ){
-				if( n == rank ) continue;
+			{
+#pragma omp for nowait
+				for( int r = 0; r < num_map*nt; ++r ){
+					const int k = r/nt, j = r%nt;
+					const double* d = &delta[k](j0 + j, i);
+					std::copy(d, d + size, delta_mat + (long long)k*ld + j*size);
+				}
 #pragma omp for nowait
-				for( int k = 0; k < size[n]/prev_num_map; ++k )
-					for( int i = 0; i < U[0].n; ++i )
-						nx_delta[j](offset[n]/prev_num_map+k, i) = buf[i*size[n]+j*size[n]/prev_num_map+k + offset[n]*U[0].n];
+				for( int r = 0; r < rows; ++r )
+					im2col_runs(U[r/mn], r%mn, j0 + ga, gb - ga, i, size, input_image + (long long)r*ld + ga*size);
 			}
+			auto end = std::chrono::system_clock::now();
+			t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			for( int g = 0; g < groups; ++g )
+				gemm_nt(rows_g, Og, (gb - ga)*size, input_image + (long long)g*rows_g*ld + ga*size, ld,
+						delta_mat + (long long)g*Og*ld + ga*size, ld, 1.0, nabla_mat + (long long)g*rows_g*Og, Og);
+			end = std::chrono::system_clock::now();
+			t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			if( da == db ) continue;
+			beg = std::chrono::system_clock::now();
+			for( int g = 0; g < groups; ++g )
+				gemm(rows_g, (db - da)*size, Og, &kernel_apply(g*rows_g, 0), Og, delta_mat + (long long)g*Og*ld + da*size, ld,
+					 0.0, col + (long long)g*rows_g*ld + da*size, ld);
+			end = std::chrono::system_clock::now();
+			t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int c = 0; c < prev_num_map; ++c )
+				for( int s = 0; s < mn; ++s )
+					col2im_runs(col + (long long)(c*mn + s)*ld + da*size, s, j0 + da, db - da, i, size,
+								nx_delta[c], my_offset, my_offset + my_size);
+			end = std::chrono::system_clock::now();
+			t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
 	}
-	end = std::chrono::system_clock::now();
-	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(2, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/B);
 
-	delete [] buf;	
-#else
-	beg = std::chrono::system_clock::now();
+	auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i ){
+		const int g = i/Og;
+		for( int j = 0; j < Cg; ++j )
+			for( int s = 0; s < mn; ++s )
+				nabla[i][j](s%n, s/n) = nabla_mat[(long long)((g*Cg + j)*mn + s)*Og + i - g*Og];
+	}
+	auto end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// Direct correlation of input and delta. Each thread takes one input map and
+// filter element and accumulates it over own output units for 4 output maps
+// at once, the innermost loop runs along the contiguous mini-batch.
+void Convolutional::calc_gradient_direct ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	const int mn = m*n, B = delta[0].n, Cg = prev_num_map/groups, Og = num_map/groups;
+	const int* feed = get_feed_idx();
 #pragma omp parallel
 	{
-		for( int j = 0; j < prev_num_map; ++j )
-#pragma omp for nowait
-			for( int k = 0; k < my_size; ++k )
-				for( int i = 0; i < U[0].n; ++i )
-					nx_delta[j](k, i) = tmp_img[i/once_num](k + (i%once_num)*my_size, j);
+		std::vector<double> acc(4*B);
+		const double* d[4];
+		double* a[4];
+		for( int l = 0; l < 4; ++l ) a[l] = &acc[l*B];
+
+#pragma omp for
+		for( int it = 0; it < prev_num_map*mn; ++it ){
+			const int c = it/mn, s = it%mn, g = c/Cg;
+			for( int o = g*Og; o < (g+1)*Og; o += 4 ){
+				const int no = std::min(4, (g+1)*Og - o);
+				std::fill(acc.begin(), acc.end(), 0.0);
+				for( int j = 0; j < my_size; ++j ){
+					const int idx = feed[j*mn + s];
+					if( idx == -1 ) continue;
+
+					for( int l = 0; l < no; ++l ) d[l] = &delta[o+l](my_offset + j, 0);
+					fma_block(no, B, d, &U[c](idx, 0), a);
+				}
+				for( int l = 0; l < no; ++l ){
+					double sum = 0.0;
+					for( int b = 0; b < B; ++b ) sum += a[l][b];
+					nabla[o+l][c - g*Cg](s%n, s/n) = sum;
+				}
+			}
+		}
 	}
-	end = std::chrono::system_clock::now();
-	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	cnt_flop += 2LL*my_size*mn*Cg*num_map*B;
+
+	auto end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+std::vector<Convolutional::Mat> Convolutional::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = (is_interleaved ? delta[0].m/num_unit : delta[0].n);
+	int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+	const int width = (is_interleaved ? B*prev_num_map : B);
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*width;
+		offset[i] = i*prev_num_unit/nprocs*width;
+	}
+
+	my_offset = offset[rank] / width;
+	my_size = size[rank] / width;
+	const bool is_maps = is_map_split();
+#else
+	const bool is_maps = false;
 #endif
 
+	const Algorithm algo = choose_algorithm(algo_delta, 1);
+	const int tile = (algo == WINOGRAD_2X2 ? 2 : 4);
+	if( !is_backward && !is_maps ){
+		if( is_pointwise() ){
+			if( kernel_delta.m == 0 ) build_kernel(true);
+		}
+		else if( algo == WINOGRAD_2X2 || algo == WINOGRAD_4X4 ){
+			if( wino_delta.m != (tile+2)*(tile+2)*prev_num_map ) winograd_filter(tile, true, wino_delta);
+		}
+		else if( algo == IM2COL && kernel_apply.m == 0 ) build_kernel(false);
+		else if( algo == DIRECT && kernel_delta.m == 0 ) build_kernel(true);
+	}
+
+	std::vector<Mat> nx_delta;
+	if( is_backward ) nx_delta.swap(backward_delta);
+	else if( !is_maps ) nx_delta = std::vector<Mat>(is_interleaved ? 1 : prev_num_map, is_interleaved ? Mat(prev_num_unit*B, prev_num_map) : Mat(prev_num_unit, B));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	// calc_backward has computed nx_delta in calc_gradient.
+	if( !is_backward ){
+#ifdef USE_MPI
+		if( is_maps )
+			calc_delta_maps(U, delta, nx_delta);
+		else
+#endif
+		if( is_pointwise() )
+			calc_delta_pointwise(delta, nx_delta, my_offset, my_size);
+		else if( is_interleaved )
+			calc_delta_interleaved(delta[0], nx_delta[0], my_offset, my_size);
+		else if( algo == DIRECT )
+			calc_delta_direct(delta, nx_delta, my_offset, my_size);
+		else if( algo == IM2COL )
+			calc_delta_im2col(delta, nx_delta, my_offset, my_size);
+		else if( algo == FFT )
+			calc_delta_fft(delta, nx_delta, my_offset, my_size);
+		else
+			winograd(tile, wino_delta, delta, nx_delta, my_offset, my_size, t_delta_repl, t_delta_gemm);
+	}
+
+#ifdef USE_MPI
 	beg = std::chrono::system_clock::now();
-	for( int i = 0; i < prev_num_map; ++i )
+	if( is_maps ) reduce_delta_maps(nx_delta, size, offset);
+	std::vector<MPI_Request> req(nx_delta.size(), MPI_REQUEST_NULL);
+	for( int i = 0; i < nx_delta.size(); ++i ){
+		if( is_spatial ){
+			std::fill(&nx_delta[i](0,0), &nx_delta[i](0,0) + offset[rank], 0.0);
+			std::fill(&nx_delta[i](0,0) + offset[rank] + size[rank], &nx_delta[i](0,0) + (long long)prev_num_unit*width, 0.0);
+		}
+		else
+			MPI_Iallgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+							&nx_delta[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world, &req[i]);
+	}
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	for( int i = 0; i < nx_delta.size(); ++i ){
+#ifdef USE_MPI
+		beg = std::chrono::system_clock::now();
+		MPI_Status stat;
+		MPI_Wait(&req[i], &stat);
+		end = std::chrono::system_clock::now();
+		t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+		beg = std::chrono::system_clock::now();
 		nx_delta[i] = Mat::hadamard(nx_delta[i], (*prev_func)(U[i], true));
+		end = std::chrono::system_clock::now();
+		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	}
+
 	end = std::chrono::system_clock::now();
-	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+// When both passes use im2col on the per map layout, delta is expanded once for
+// the GEMMs of the gradient and of nx_delta, otherwise they run one by one.
+std::vector<std::vector<Convolutional::Mat>> Convolutional::calc_backward ( const std::vector<Mat>& U, const std::vector<Mat>& delta,
+																			std::vector<Mat>& nx_delta, const bool need_delta )
+{
+	is_backward = (need_delta && !is_interleaved && !is_pointwise() &&
+				   choose_algorithm(algo_grad, 2) == IM2COL && choose_algorithm(algo_delta, 1) == IM2COL);
+#ifdef USE_MPI
+	// part of the maps chooses for itself.
+	if( is_map_split() ) is_backward = need_delta;
+#endif
+	std::vector<std::vector<Mat>> nabla = calc_gradient(U, delta);
+	if( need_delta ) nx_delta = calc_delta(U, delta);
+	is_backward = false;
+
+	return nabla;
+}
+
+#ifdef USE_MPI
+bool Convolutional::is_map_split () const
+{
+	return partition == MAP && nprocs > 1;
+}
+
+// output maps of the rank r, grouped layers are split by whole groups so that
+// part is a grouped layer too.
+void Convolutional::map_range ( const int r, int& beg, int& end ) const
+{
+	const int cnt = (groups == 1 ? num_map : groups), w = (groups == 1 ? 1 : num_map/groups);
+	beg = r*cnt/nprocs*w; end = (r+1)*cnt/nprocs*w;
+}
+
+void Convolutional::setup_part ()
+{
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	map_range(rank, map_beg, map_end);
+	if( map_beg == map_end ) return;
+
+	if( !part ){
+		const int ng = (groups == 1 ? 1 : (map_end - map_beg)/Og);
+		part = std::shared_ptr<Convolutional>(new Convolutional(ng*Cg, prev_num_unit, prev_ldu, map_end - map_beg, num_unit, ldu,
+																m, n, stride, pad_top, pad_bottom, pad_left, pad_right,
+																std::shared_ptr<Function>(new Identity), false, ng, dilation_y, dilation_x));
+		std::mt19937 mt;
+		part->init(mt, MPI_COMM_SELF, MPI_COMM_SELF);
+		// U is given through prev_func, and nx_delta is multiplied by its
+		// derivative after the reduction.
+		part->set_prev_function(std::shared_ptr<Function>(new Identity));
+		for( int i = 0; i < 3; ++i ) part->once_num[i] = once_num[i];
+		is_part_stale = true;
+	}
+	part->set_workspace(workspace);
+	part->set_algorithm(algo_apply, algo_delta, algo_grad);
+	part->once_budget = once_budget;
+	if( part->is_interleaved != is_interleaved ) part->set_interleaved(is_interleaved);
+	if( is_part_stale ){
+		for( int i = map_beg; i < map_end; ++i ) part->W[i - map_beg] = W[i];
+		part->clear_kernel();
+		is_part_stale = false;
+	}
+}
+
+// maps [beg, end) of U in the layout of the layer.
+std::vector<Convolutional::Mat> Convolutional::slice_maps ( const std::vector<Mat>& U, const int beg, const int end ) const
+{
+	if( !is_interleaved ) return std::vector<Mat>(U.begin() + beg, U.begin() + end);
+
+	std::vector<Mat> ret(1, Mat(U[0].m, end - beg));
+#pragma omp parallel for
+	for( int j = 0; j < U[0].m; ++j )
+		std::copy(&U[0](j, beg), &U[0](j, end), &ret[0](j, 0));
+	return ret;
+}
+
+// Own maps over all units are computed by part, then every map is broadcast
+// from the rank owning it. A map of the interleaved layout is a column of ret.
+void Convolutional::apply_maps ( const std::vector<Mat>& U, std::vector<Mat>& ret )
+{
+	auto beg = std::chrono::system_clock::now();
+	setup_part();
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( map_beg != map_end ){
+		std::vector<Mat> U_in;
+		if( groups != 1 ) U_in = slice_maps(U, map_beg/Og*Cg, map_end/Og*Cg);
+		std::vector<Mat> V = part->apply(groups == 1 ? U : U_in, false);
+		if( is_interleaved ){
+#pragma omp parallel for
+			for( int j = 0; j < V[0].m; ++j )
+				std::copy(&V[0](j, 0), &V[0](j, 0) + V[0].n, &ret[0](j, map_beg));
+		}
+		else
+			for( int i = map_beg; i < map_end; ++i ) ret[i] = V[i - map_beg];
+	}
+	auto end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	MPI_Datatype col;
+	if( is_interleaved ){
+		MPI_Type_vector(ret[0].m, 1, num_map, MPI_DOUBLE_PRECISION, &col);
+		MPI_Type_commit(&col);
+	}
+	std::vector<MPI_Request> req(num_map);
+	for( int r = 0; r < nprocs; ++r ){
+		int a, b;
+		map_range(r, a, b);
+		for( int i = a; i < b; ++i )
+			if( is_interleaved ) MPI_Ibcast(&ret[0](0, i), 1, col, r, inner_world, &req[i]);
+			else MPI_Ibcast(&ret[i](0,0), ret[i].m*ret[i].n, MPI_DOUBLE_PRECISION, r, inner_world, &req[i]);
+	}
+	std::vector<MPI_Status> stat(num_map);
+	MPI_Waitall(num_map, &req[0], &stat[0]);
+	if( is_interleaved ) MPI_Type_free(&col);
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// nabla of own maps by part, the others are left zero for the reduction over
+// the ranks. For calc_backward part gives its nx_delta to backward_delta.
+void Convolutional::calc_gradient_maps ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	auto beg = std::chrono::system_clock::now();
+	setup_part();
+	const int B = (is_interleaved ? delta[0].m/num_unit : delta[0].n);
+	for( int i = 0; i < num_map; ++i )
+		for( int j = 0; j < nabla[i].size(); ++j )
+			std::fill(&nabla[i][j](0,0), &nabla[i][j](0,0) + nabla[i][j].m*nabla[i][j].n, 0.0);
+
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( map_beg != map_end ){
+		std::vector<Mat> U_in;
+		if( groups != 1 ) U_in = slice_maps(U, map_beg/Og*Cg, map_end/Og*Cg);
+		const std::vector<Mat> D = slice_maps(delta, map_beg, map_end);
+		std::vector<std::vector<Mat>> g;
+		if( is_backward ){
+			g = part->calc_backward(groups == 1 ? U : U_in, D, backward_delta, true);
+			expand_part_delta(backward_delta, B);
+		}
+		else
+			g = part->calc_gradient(groups == 1 ? U : U_in, D);
+		for( int i = map_beg; i < map_end; ++i ) nabla[i] = g[i - map_beg];
+	}
+	else if( is_backward ){
+		backward_delta.clear();
+		expand_part_delta(backward_delta, B);
+	}
+	auto end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// nx_delta of the input maps of part to all input maps, the others are zero.
+void Convolutional::expand_part_delta ( std::vector<Mat>& nx_delta, const int B ) const
+{
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	int c_beg = (groups == 1 ? 0 : map_beg/Og*Cg), c_end = (groups == 1 ? prev_num_map : map_end/Og*Cg);
+	if( map_beg == map_end ) c_beg = c_end = 0;
+	else if( c_beg == 0 && c_end == prev_num_map ) return;
+
+	std::vector<Mat> part_delta;
+	part_delta.swap(nx_delta);
+	if( is_interleaved ){
+		nx_delta = std::vector<Mat>(1, Mat(prev_num_unit*B, prev_num_map));
+#pragma omp parallel for
+		for( int j = 0; j < prev_num_unit*B; ++j ){
+			std::fill(&nx_delta[0](j, 0), &nx_delta[0](j, 0) + prev_num_map, 0.0);
+			if( c_beg != c_end ) std::copy(&part_delta[0](j, 0), &part_delta[0](j, 0) + (c_end - c_beg), &nx_delta[0](j, c_beg));
+		}
+	}
+	else{
+		nx_delta = std::vector<Mat>(prev_num_map);
+		for( int c = 0; c < prev_num_map; ++c )
+			if( c_beg <= c && c < c_end ) nx_delta[c] = part_delta[c - c_beg];
+			else nx_delta[c] = Mat::zeros(prev_num_unit, B);
+	}
+}
+
+// partial nx_delta of own maps over all units, to be summed over the ranks.
+void Convolutional::calc_delta_maps ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<Mat>& nx_delta )
+{
+	auto beg = std::chrono::system_clock::now();
+	setup_part();
+	const int B = (is_interleaved ? delta[0].m/num_unit : delta[0].n);
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( map_beg != map_end ){
+		std::vector<Mat> U_in;
+		if( groups != 1 ) U_in = slice_maps(U, map_beg/Og*Cg, map_end/Og*Cg);
+		nx_delta = part->calc_delta(groups == 1 ? U : U_in, slice_maps(delta, map_beg, map_end));
+	}
+	expand_part_delta(nx_delta, B);
+	auto end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// Sums the partial nx_delta of the ranks into own band of units, which the
+// gather of calc_delta then gives to all ranks.
+void Convolutional::reduce_delta_maps ( std::vector<Mat>& nx_delta, const std::vector<int>& size, const std::vector<int>& offset )
+{
+	double* band = workspace->get(0, (long long)nx_delta.size()*size[rank]);
+	std::vector<MPI_Request> req(nx_delta.size());
+	for( int i = 0; i < nx_delta.size(); ++i )
+		MPI_Ireduce_scatter(&nx_delta[i](0,0), band + (long long)i*size[rank], &size[0], MPI_DOUBLE_PRECISION,
+							MPI_SUM, inner_world, &req[i]);
+	std::vector<MPI_Status> stat(nx_delta.size());
+	MPI_Waitall(nx_delta.size(), &req[0], &stat[0]);
+	for( int i = 0; i < nx_delta.size(); ++i )
+		std::copy(band + (long long)i*size[rank], band + (long long)(i+1)*size[rank], &nx_delta[i](0,0) + offset[rank]);
+}
+#endif
+
+// GEMM of the kernel and delta followed by col2im, so that the cost follows the
+// number of output units for any stride. Columns of the output units
+// [delta_beg, delta_end) are added to own input units. Columns run over the
+// output units and the mini-batch, then a row of the GEMM output is added to
+// nx_delta by runs along the output rows. The output
+// units are taken in tiles which fit the cache. Each group has its own GEMM on
+// its rows of the kernel and delta.
+void Convolutional::calc_delta_im2col ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size )
+{
+	const int len = delta_end - delta_beg, mn = m*n, rows = mn*prev_num_map;
+	const int Og = num_map/groups, rows_g = rows/groups;
+
+#pragma omp parallel for
+	for( int c = 0; c < prev_num_map; ++c )
+		std::fill(&nx_delta[c](my_offset, 0), &nx_delta[c](my_offset, 0) + (long long)my_size*delta[0].n, 0.0);
+	if( len == 0 ) return;
+
+	const int once_num = get_once_num(1, len, delta[0].n);
+	const int tile = (int)std::max(1LL, std::min((long long)len, std::min(cache_size(), workspace->get_limit())/(8LL*once_num*(rows + num_map))));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* delta_mat = workspace->get(0, (long long)num_map*tile*once_num);
+	double* col = workspace->get(1, (long long)rows*tile*once_num);
+	for( int i = 0; i < delta[0].n; i += once_num ){
+		int size = std::min(once_num, delta[0].n - i);
+
+		for( int j0 = 0; j0 < len; j0 += tile ){
+			const int nt = std::min(tile, len - j0), ld = nt*size;
+			auto beg = std::chrono::system_clock::now();
+
+#pragma omp parallel for
+			for( int r = 0; r < num_map*nt; ++r ){
+				const int k = r/nt, j = r%nt;
+				const double* d = &delta[k](delta_beg + j0 + j, i);
+				std::copy(d, d + size, delta_mat + (long long)k*ld + j*size);
+			}
+			auto end = std::chrono::system_clock::now();
+			t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			for( int g = 0; g < groups; ++g )
+				gemm(rows_g, ld, Og, &kernel_apply(g*rows_g, 0), Og, delta_mat + (long long)g*Og*ld, ld,
+					 0.0, col + (long long)g*rows_g*ld, ld);
+			end = std::chrono::system_clock::now();
+			t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int c = 0; c < prev_num_map; ++c )
+				for( int s = 0; s < mn; ++s )
+					col2im_runs(col + (long long)(c*mn + s)*ld, s, delta_beg + j0, nt, i, size,
+								nx_delta[c], my_offset, my_offset + my_size);
+			end = std::chrono::system_clock::now();
+			t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
+	}
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(1, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/delta[0].n);
+}
+
+// Direct transposed convolution. Each thread takes one input unit and gathers
+// delta of the output units which use it, for 4 input maps at once.
+void Convolutional::calc_delta_direct ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int mn = m*n, B = delta[0].n, Cg = prev_num_map/groups, Og = num_map/groups;
+	const int Y_ = num_unit/ldu, X_ = ldu;
+#pragma omp parallel for
+	for( int j = 0; j < my_size; ++j ){
+		const int x = (my_offset + j)%prev_ldu, y = (my_offset + j)/prev_ldu;
+		double* v[4];
+
+		for( int g = 0; g < groups; ++g )
+			for( int c = g*Cg; c < (g+1)*Cg; c += 4 ){
+				const int nc = std::min(4, (g+1)*Cg - c);
+				for( int l = 0; l < nc; ++l ){
+					v[l] = &nx_delta[c+l](my_offset + j, 0);
+					std::fill(v[l], v[l] + B, 0.0);
+				}
 
-	end = std::chrono::system_clock::now();
-	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+				for( int t = 0; t < m; ++t ){
+					const int ny = y + pad_top - t*dilation_y;
+					if( ny < 0 || ny%stride != 0 || ny/stride >= Y_ ) continue;
+					for( int s = 0; s < n; ++s ){
+						const int nx = x + pad_left - s*dilation_x;
+						if( nx < 0 || nx%stride != 0 || nx/stride >= X_ ) continue;
+
+						const int idx = (ny/stride)*ldu + nx/stride;
+						for( int k = g*Og; k < (g+1)*Og; ++k )
+							axpy_block(nc, B, &kernel_delta(k*mn + t*n + s, c - g*Cg), &delta[k](idx, 0), v);
+					}
+				}
+			}
+	}
+	cnt_flop += 2LL*my_size*mn*prev_num_map*Og*B;
 
-	return nx_delta;
+	auto end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 }
 
 void Convolutional::update_W ( const std::vector<std::vector<Mat>>& dW )
@@ -505,7 +2029,7 @@ void Convolutional::update_W ( const std::vector<std::vector<Mat>>& dW )
 	beta_ *= a_beta; gamma_ *= a_gamma;
 #pragma omp parallel for    // @@@ add
 	for( int i = 0; i < num_map; ++i ){
-		for( int j = 0; j < prev_num_map; ++j )
+		for( int j = 0; j < W[i].size(); ++j )
 			W[i][j] += dW[i][j];
 
 		if( is_use_bias ){
@@ -514,6 +2038,7 @@ void Convolutional::update_W ( const std::vector<std::vector<Mat>>& dW )
 			bias[i] -= 0.001*v[i]/(1.0 - beta_)/(sqrt(r[i]/(1.0 - gamma_)+a_eps));
 		}
 	}
+	clear_kernel();
 }
 
 std::vector<Convolutional::Mat> Convolutional::apply ( const std::vector<Mat>& U, bool use_func )
@@ -521,146 +2046,536 @@ std::vector<Convolutional::Mat> Convolutional::apply ( const std::vector<Mat>& U
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
+	// a unit has B values in each map, or B*num_map values in the interleaved layout.
+	const int B = (is_interleaved ? U[0].m/prev_num_unit : U[0].n);
 	int my_size = num_unit, my_offset = 0;
 #ifdef USE_MPI
+	const int width = (is_interleaved ? B*num_map : B);
 	std::vector<int> size(nprocs), offset(nprocs);
 	for( int i = 0; i < nprocs; ++i ){		
-		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*num_map;
-		offset[i] = i*num_unit/nprocs*num_map;
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*width;
+		offset[i] = i*num_unit/nprocs*width;
 	}
 
-	my_offset = offset[rank] / num_map;
-	my_size = size[rank] / num_map;
+	my_offset = offset[rank] / width;
+	my_size = size[rank] / width;
+	const bool is_maps = is_map_split();
+#else
+	const bool is_maps = false;
 #endif
 	
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	const Algorithm algo = choose_algorithm(algo_apply, 0);
+	const int tile = (algo == WINOGRAD_2X2 ? 2 : 4);
+	// part of the maps builds its own kernels.
+	if( !is_maps ){
+		if( is_pointwise() ){
+			if( kernel_apply.m == 0 ) build_kernel(false);
+		}
+		else if( algo == WINOGRAD_2X2 || algo == WINOGRAD_4X4 ){
+			if( wino_apply.m != (tile+2)*(tile+2)*num_map ) winograd_filter(tile, false, wino_apply);
+		}
+		else if( algo != FFT && kernel_apply.m == 0 ) build_kernel(false);
+	}
 
-	Mat kernel(m*n*prev_num_map, num_map);
-#pragma omp parallel for
-	for( int j = 0; j < prev_num_map; ++j )
-		for( int l = 0; l < n; ++l )
-			for( int k = 0; k < m; ++ k )
-				for( int i = 0; i < num_map; ++i )
-					kernel(j*(m*n) + l*n + k, i) = W[i][j](k, l);
+	std::vector<Mat> ret(is_interleaved ? 1 : num_map, is_interleaved ? Mat(num_unit*B, num_map) : Mat(num_unit, B));
 	auto end = std::chrono::system_clock::now();
 	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
-	Mat input_image(my_size*once_num, m*n*prev_num_map);
-	std::vector<Mat> tmp_img(U[0].n/once_num + 1);
-	for( int i = 0; i < U[0].n; i += once_num ){
-		int size = std::min(once_num, U[0].n - i);
+#ifdef USE_MPI
+	if( is_maps )
+		apply_maps(U, ret);
+	else
+#endif
+	if( is_pointwise() )
+		apply_pointwise(U, ret, my_offset, my_size);
+	else if( is_interleaved )
+		apply_interleaved(U[0], ret[0], my_offset, my_size);
+	else if( algo == DIRECT )
+		apply_direct(U, ret, my_offset, my_size);
+	else if( algo == IM2COL )
+		apply_im2col(U, ret, my_offset, my_size);
+	else if( algo == FFT )
+		apply_fft(U, ret, my_offset, my_size);
+	else
+		winograd(tile, wino_apply, U, ret, my_offset, my_size, t_apply_repl, t_apply_gemm);
 
-		auto beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	if( is_spatial ){
+		// the other bands are left zero.
+		for( int i = 0; i < ret.size(); ++i ){
+			std::fill(&ret[i](0,0), &ret[i](0,0) + offset[rank], 0.0);
+			std::fill(&ret[i](0,0) + offset[rank] + size[rank], &ret[i](0,0) + (long long)num_unit*width, 0.0);
+		}
+	}
+	else if( !is_maps ){
+		std::vector<MPI_Request> req(ret.size());
+		for( int i = 0; i < ret.size(); ++i )
+			MPI_Iallgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+							&ret[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world, &req[i]);
+		for( int i = 0; i < ret.size(); ++i ){
+			MPI_Status stat;
+			MPI_Wait(&req[i], &stat);
+		}
+	}
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	// rows [r0, r1) of ret hold the computed units, with is_spatial only own
+	// band gets the bias and the activation.
+	int r0 = 0, r1 = ret[0].m;
+#ifdef USE_MPI
+	if( is_spatial ){
+		r0 = (is_interleaved ? my_offset*B : my_offset);
+		r1 = (is_interleaved ? (my_offset + my_size)*B : my_offset + my_size);
+	}
+#endif
+	if( is_use_bias && is_interleaved ){
+#pragma omp parallel for
+		for( int j = r0; j < r1; ++j )
+			for( int i = 0; i < num_map; ++i )
+				ret[0](j,i) += bias[i];
+	}
+	else if( is_use_bias ){
 #pragma omp parallel
 		{
-			for( int l = 0; l < size; ++l )
+			for( int i = 0; i < num_map; ++i )
 #pragma omp for nowait
-				for( int j = 0; j < my_size; ++j )
-					for( int k = 0; k < prev_num_map; ++k )
-						for( int s = 0; s < m*n; ++ s ){
-							input_image(l*my_size + j, m*n*k + s) = (feed_idx[j*m*n + s] != -1 ? U[k](feed_idx[j*m*n + s], i+l) : 0.0);
-						}
+				for( int j = r0; j < r1; ++j )
+					for( int k = 0; k < ret[0].n; ++k )
+						ret[i](j,k) += bias[i];
+		}
+	}
+
+	if( use_func )
+		for( int i = 0; i < ret.size(); ++i ){
+			if( r1 - r0 == ret[i].m ){
+				ret[i] = (*func)(ret[i], false);
+				continue;
+			}
+			if( r0 == r1 ) continue;
+
+			const long long len = (long long)(r1 - r0)*ret[i].n;
+			Mat band(r1 - r0, ret[i].n);
+			std::copy(&ret[i](r0,0), &ret[i](r0,0) + len, &band(0,0));
+			band = (*func)(band, false);
+			std::copy(&band(0,0), &band(0,0) + len, &ret[i](r0,0));
+		}
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	end = std::chrono::system_clock::now();
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+	
+	return ret;
+}
+
+// im2col as the transposed problem, columns of the image run over own output
+// units and the mini-batch so that a row of the GEMM output is a run of ret[i].
+// The output units are taken in tiles which fit the cache and the rows are
+// stored into ret from there. Each group has its own GEMM on its rows of the
+// image.
+void Convolutional::apply_im2col ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size )
+{
+	const int mn = m*n, rows = mn*prev_num_map;
+	const int Og = num_map/groups, rows_g = rows/groups;
+	Mat kernel(num_map, rows_g);
+#pragma omp parallel for
+	for( int k = 0; k < num_map; ++k )
+		for( int j = 0; j < rows_g; ++j )
+			kernel(k, j) = kernel_apply((k/Og)*rows_g + j, k%Og);
+
+	const int once_num = get_once_num(0, my_size, U[0].n);
+	const int tile = (int)std::max(1LL, std::min((long long)my_size, std::min(cache_size(), workspace->get_limit())/(8LL*once_num*(rows + num_map))));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* input_image = workspace->get(0, (long long)rows*tile*once_num);
+	double* tmp_img = workspace->get(1, (long long)num_map*tile*once_num);
+	for( int i = 0; i < U[0].n; i += once_num ){
+		int size = std::min(once_num, U[0].n - i);
+
+		for( int j0 = 0; j0 < my_size; j0 += tile ){
+			const int nt = std::min(tile, my_size - j0), ld = nt*size;
+			auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int r = 0; r < rows; ++r )
+				im2col_runs(U[r/mn], r%mn, my_offset + j0, nt, i, size, input_image + (long long)r*ld);
+			auto end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			for( int g = 0; g < groups; ++g )
+				gemm(Og, ld, rows_g, &kernel(g*Og, 0), rows_g, input_image + (long long)g*rows_g*ld, ld,
+					 0.0, tmp_img + (long long)g*Og*ld, ld);
+			end = std::chrono::system_clock::now();
+			t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int r = 0; r < num_map*nt; ++r ){
+				const int k = r/nt, j = r%nt;
+				const double* x = tmp_img + (long long)k*ld + j*size;
+				std::copy(x, x + size, &ret[k](my_offset + j0 + j, i));
+			}
+			end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 		}
+	}
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(0, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/U[0].n);
+}
+
+// Direct convolution. Each thread takes one output unit and computes it for
+// 4 output maps at once, the innermost loop runs along the contiguous mini-batch.
+void Convolutional::apply_direct ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int mn = m*n, B = U[0].n, Cg = prev_num_map/groups, Og = num_map/groups;
+	const int* feed = get_feed_idx();
+#pragma omp parallel for
+	for( int j = 0; j < my_size; ++j ){
+		double* v[4];
+
+		for( int g = 0; g < groups; ++g )
+			for( int o = g*Og; o < (g+1)*Og; o += 4 ){
+				const int no = std::min(4, (g+1)*Og - o);
+				for( int l = 0; l < no; ++l ){
+					v[l] = &ret[o+l](my_offset + j, 0);
+					std::fill(v[l], v[l] + B, 0.0);
+				}
+
+				for( int k = g*Cg; k < (g+1)*Cg; ++k )
+					for( int s = 0; s < mn; ++s ){
+						const int idx = feed[j*mn + s];
+						if( idx == -1 ) continue;
+
+						axpy_block(no, B, &kernel_apply(k*mn + s, o - g*Og), &U[k](idx, 0), v);
+					}
+			}
+	}
+	cnt_flop += 2LL*my_size*mn*Cg*num_map*B;
+
+	auto end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// im2col of the interleaved layout. A row of the image is an output unit of a
+// sample, and each filter element copies the contiguous maps of an input unit.
+// The GEMM writes the rows of the output units in the layout of the layer.
+// once_num samples of the per map image are taken as the same number of rows.
+// Columns of the image are grouped, and each group writes its own columns of ret.
+void Convolutional::apply_interleaved ( const Mat& U, Mat& ret, const int my_offset, const int my_size )
+{
+	const int B = U.m/prev_num_unit, mn = m*n, C = prev_num_map;
+	const int Cg = C/groups, Og = num_map/groups;
+	const int* feed = get_feed_idx();
+	const int once_num = get_once_num(0, my_size, B);
+	const int P = std::max(1, std::min(my_size, once_num*my_size/B));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* input_image = workspace->get(0, (long long)P*B*mn*C);
+	for( int j0 = 0; j0 < my_size; j0 += P ){
+		const int np = std::min(P, my_size - j0);
+
+		auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+		for( int j = 0; j < np; ++j )
+			for( int s = 0; s < mn; ++s ){
+				const int idx = feed[(j0 + j)*mn + s];
+				for( int b = 0; b < B; ++b )
+					for( int g = 0; g < groups; ++g ){
+						double* dst = input_image + (long long)(j*B + b)*mn*C + (g*mn + s)*Cg;
+						if( idx == -1 ) std::fill(dst, dst + Cg, 0.0);
+						else std::copy(&U(idx*B + b, g*Cg), &U(idx*B + b, g*Cg) + Cg, dst);
+					}
+			}
 		auto end = std::chrono::system_clock::now();
 		t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
 		beg = std::chrono::system_clock::now();
-		tmp_img[i/once_num] = input_image * kernel;
+		for( int g = 0; g < groups; ++g )
+			gemm(np*B, Og, mn*Cg, input_image + g*mn*Cg, mn*C, &kernel_apply(g*mn*Cg, 0), Og,
+				 0.0, &ret((my_offset + j0)*B, g*Og), num_map);
 		end = std::chrono::system_clock::now();
 		t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 	}
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(0, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/B);
+}
 
-	std::vector<Mat> ret(num_map, Mat(num_unit, U[0].n));
-#ifdef USE_MPI
-	beg = std::chrono::system_clock::now();
-	double* buf = new double[U[0].n*num_unit*num_map];
+// GEMM of the rows of delta and col2im of the interleaved layout. Each thread
+// takes samples, so that no two threads add to the same row of nx_delta.
+void Convolutional::calc_delta_interleaved ( const Mat& delta, Mat& nx_delta, const int my_offset, const int my_size )
+{
+	const int B = delta.m/num_unit, len = delta_end - delta_beg, mn = m*n, C = prev_num_map;
+	const int Cg = C/groups, Og = num_map/groups;
 
-#pragma omp parallel
-	{
-		for( int i = 0; i < U[0].n; ++i )
-#pragma omp for nowait
-			for( int j = 0; j < num_map; ++j )
-				for( int k = 0; k < my_size; ++k )
-					buf[i*(num_map*my_size) + j*my_size + k + offset[rank]*U[0].n] = tmp_img[i/once_num](k + (i%once_num)*my_size, j);
-	}
+	std::fill(&nx_delta(0,0) + (long long)my_offset*B*C, &nx_delta(0,0) + (long long)(my_offset + my_size)*B*C, 0.0);
+	if( len == 0 ) return;
 
-	std::vector<int> gath_size(nprocs), gath_displs(nprocs);
-	for( int i = 0; i < nprocs; ++i ){
-		gath_size[i] = size[i]*U[0].n;
-		gath_displs[i] = offset[i]*U[0].n;
-	}
+	const int* didx = get_delta_idx();
+	const int once_num = get_once_num(1, len, B);
+	const int P = std::max(1, std::min(len, once_num*len/B));
+	auto tot_beg = std::chrono::system_clock::now();
 
-	MPI_Request req;
-	MPI_Iallgatherv(MPI_IN_PLACE, gath_size[rank], MPI_DOUBLE_PRECISION,
-					buf, &gath_size[0], &gath_displs[0], MPI_DOUBLE_PRECISION, inner_world, &req);
-	end = std::chrono::system_clock::now();
-	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	Mat kernel(num_map, mn*Cg);
+#pragma omp parallel for
+	for( int k = 0; k < num_map; ++k )
+		for( int j = 0; j < mn*Cg; ++j )
+			kernel(k, j) = kernel_apply((k/Og)*mn*Cg + j, k%Og);
 
-	beg = std::chrono::system_clock::now();
-#pragma omp parallel
-	{
-		for( int j = 0; j < num_map; ++j )
-#pragma omp for nowait
-			for( int k = 0; k < size[rank]/num_map; ++k )
-				for( int i = 0; i < U[0].n; ++i )
-						ret[j](offset[rank]/num_map+k, i) = buf[i*size[rank]+j*size[rank]/num_map+k + offset[rank]*U[0].n];
+	double* col = workspace->get(0, (long long)P*B*mn*C);
+	for( int j0 = 0; j0 < len; j0 += P ){
+		const int np = std::min(P, len - j0);
+
+		auto beg = std::chrono::system_clock::now();
+		for( int g = 0; g < groups; ++g )
+			gemm(np*B, mn*Cg, Og, &delta((delta_beg + j0)*B, g*Og), num_map, &kernel(g*Og, 0), mn*Cg,
+				 0.0, col + g*mn*Cg, mn*C);
+		auto end = std::chrono::system_clock::now();
+		t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+		for( int b = 0; b < B; ++b )
+			for( int j = 0; j < np; ++j )
+				for( int s = 0; s < mn; ++s ){
+					const int idx = didx[(j0 + j)*mn + s];
+					if( idx == -1 ) continue;
+
+					for( int g = 0; g < groups; ++g ){
+						double* dst = &nx_delta((my_offset + idx)*B + b, g*Cg);
+						const double* src = col + (long long)(j*B + b)*mn*C + (g*mn + s)*Cg;
+						for( int c = 0; c < Cg; ++c ) dst[c] += src[c];
+					}
+				}
+		end = std::chrono::system_clock::now();
+		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 	}
+	auto tot_end = std::chrono::system_clock::now();
+	set_once_time(1, std::chrono::duration_cast<std::chrono::nanoseconds>(tot_end - tot_beg).count()/1e9/B);
+}
 
-	MPI_Status stat;
-	MPI_Wait(&req, &stat);
+// Transposed im2col of own output units times the rows of delta, which are
+// accumulated over chunks of the output units.
+void Convolutional::calc_gradient_interleaved ( const Mat& U, const Mat& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	const int B = U.m/prev_num_unit, mn = m*n, C = prev_num_map;
+	const int Cg = C/groups, Og = num_map/groups;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
 
-#pragma omp parallel
-	{
-		for( int j = 0; j < num_map; ++j )
-			for( int n = 0; n < nprocs; ++n ){
-				if( n == rank ) continue;
-#pragma omp for nowait
-				for( int k = 0; k < size[n]/num_map; ++k )
-					for( int i = 0; i < U[0].n; ++i )
-						ret[j](offset[n]/num_map+k, i) = buf[i*size[n]+j*size[n]/num_map+k + offset[n]*U[0].n];
+	const int* feed = get_feed_idx();
+	const int once_num = get_once_num(2, my_size, B);
+	const int P = std::max(1, std::min(my_size, once_num*my_size/B));
+	auto tot_beg = std::chrono::system_clock::now();
+
+	double* nabla_mat = workspace->get(0, (long long)mn*C*Og);
+	double* image = workspace->get(1, (long long)mn*C*P*B);
+	std::fill(nabla_mat, nabla_mat + (long long)mn*C*Og, 0.0);
+	for( int j0 = 0; j0 < my_size; j0 += P ){
+		const int np = std::min(P, my_size - j0);
+
+		auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+		for( int r = 0; r < mn*C; ++r ){
+			const int s = r/Cg%mn, c = r/(mn*Cg)*Cg + r%Cg;
+			for( int j = 0; j < np; ++j ){
+				const int idx = feed[(j0 + j)*mn + s];
+				for( int b = 0; b < B; ++b )
+					image[(long long)r*P*B + j*B + b] = (idx == -1 ? 0.0 : U(idx*B + b, c));
 			}
+		}
+		auto end = std::chrono::system_clock::now();
+		t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		beg = std::chrono::system_clock::now();
+		for( int g = 0; g < groups; ++g )
+			gemm(mn*Cg, Og, np*B, image + (long long)g*mn*Cg*P*B, P*B, &delta((my_offset + j0)*B, g*Og), num_map,
+				 1.0, nabla_mat + (long long)g*mn*Cg*Og, Og);
+		end = std::chrono::system_clock::now();
+		t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 	}
-	end = std::chrono::system_clock::now();
-	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
-	delete [] buf;
-#else
-	beg = std::chrono::system_clock::now();
+	auto beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i ){
+		const int g = i/Og;
+		for( int j = 0; j < Cg; ++j )
+			for( int s = 0; s < mn; ++s )
+				nabla[i][j](s%n, s/n) = nabla_mat[(long long)((g*mn + s)*Cg + j)*Og + i - g*Og];
+	}
+	auto end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	set_once_time(2, std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9/B);
+}
 
+// 1x1 convolution as a GEMM of the kernel and own units of the maps. The
+// interleaved layout is multiplied in place. In the per map layout the units
+// and the mini-batch of a map are one contiguous run, and the runs are taken in
+// chunks whose rows of the input maps of a group fit the cache, computing 4
+// output maps at once.
+void Convolutional::apply_pointwise ( const std::vector<Mat>& U, std::vector<Mat>& ret, const int my_offset, const int my_size )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( is_interleaved ){
+		const int B = U[0].m/prev_num_unit;
+		for( int g = 0; g < groups; ++g )
+			gemm(my_size*B, Og, Cg, &U[0](my_offset*B, g*Cg), prev_num_map, &kernel_apply(g*Cg, 0), Og,
+				 0.0, &ret[0](my_offset*B, g*Og), num_map);
+	}
+	else{
+		const long long col_beg = (long long)my_offset*U[0].n, len = (long long)my_size*U[0].n;
+		const int chunk = (int)std::max(64LL, std::min(len, cache_size()/(16LL*(Cg + 4))));
+		const int num_chunk = (int)((len + chunk - 1)/chunk);
 #pragma omp parallel
-	{
-		for( int j = 0; j < num_map; ++j )
-#pragma omp for nowait
-			for( int k = 0; k < num_unit; ++k )
-				for( int i = 0; i < U[0].n; ++i )
-					ret[j](k, i) = tmp_img[i/once_num](k + (i%once_num)*my_size, j);
+		{
+			std::vector<const double*> x(Cg);
+#pragma omp for
+			for( int q = 0; q < num_chunk*groups; ++q ){
+				const int g = q%groups;
+				const long long j0 = col_beg + (long long)(q/groups)*chunk;
+				const int l = (int)std::min((long long)chunk, col_beg + len - j0);
+				for( int c = 0; c < Cg; ++c ) x[c] = &U[g*Cg + c](0,0) + j0;
+
+				double* v[4];
+				for( int o = g*Og; o < (g+1)*Og; o += 4 ){
+					const int no = std::min(4, (g+1)*Og - o);
+					for( int k = 0; k < no; ++k ){
+						v[k] = &ret[o+k](0,0) + j0;
+						std::fill(v[k], v[k] + l, 0.0);
+					}
+					gemm_block(no, Cg, l, &kernel_apply(g*Cg, o - g*Og), Og, &x[0], v);
+				}
+			}
+		}
+		cnt_flop += 2LL*len*Cg*num_map;
 	}
-	end = std::chrono::system_clock::now();
-	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-#endif
 
-	beg = std::chrono::system_clock::now();
-	if( is_use_bias ){
+	auto end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+// Transpose of apply_pointwise on own input units, which are own output units.
+void Convolutional::calc_delta_pointwise ( const std::vector<Mat>& delta, std::vector<Mat>& nx_delta, const int my_offset, const int my_size )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	if( is_interleaved ){
+		const int B = delta[0].m/num_unit;
+		for( int g = 0; g < groups; ++g )
+			gemm(my_size*B, Cg, Og, &delta[0](my_offset*B, g*Og), num_map, &kernel_delta(g*Og, 0), Cg,
+				 0.0, &nx_delta[0](my_offset*B, g*Cg), prev_num_map);
+	}
+	else{
+		const long long col_beg = (long long)my_offset*delta[0].n, len = (long long)my_size*delta[0].n;
+		const int chunk = (int)std::max(64LL, std::min(len, cache_size()/(16LL*(Og + 4))));
+		const int num_chunk = (int)((len + chunk - 1)/chunk);
 #pragma omp parallel
 		{
-			for( int i = 0; i < num_map; ++i )
-#pragma omp for nowait
-				for( int j = 0; j < ret[0].m; ++j )
-					for( int k = 0; k < ret[0].n; ++k )
-						ret[i](j,k) += bias[i];
+			std::vector<const double*> x(Og);
+#pragma omp for
+			for( int q = 0; q < num_chunk*groups; ++q ){
+				const int g = q%groups;
+				const long long j0 = col_beg + (long long)(q/groups)*chunk;
+				const int l = (int)std::min((long long)chunk, col_beg + len - j0);
+				for( int o = 0; o < Og; ++o ) x[o] = &delta[g*Og + o](0,0) + j0;
+
+				double* v[4];
+				for( int c = g*Cg; c < (g+1)*Cg; c += 4 ){
+					const int nc = std::min(4, (g+1)*Cg - c);
+					for( int k = 0; k < nc; ++k ){
+						v[k] = &nx_delta[c+k](0,0) + j0;
+						std::fill(v[k], v[k] + l, 0.0);
+					}
+					gemm_block(nc, Og, l, &kernel_delta(g*Og, c - g*Cg), Cg, &x[0], v);
+				}
+			}
 		}
+		cnt_flop += 2LL*len*Og*prev_num_map;
 	}
 
-	if( use_func )
-		for( int i = 0; i < num_map; ++i )
-			ret[i] = (*func)(ret[i], false);
-	end = std::chrono::system_clock::now();
-	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	auto end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
 
-	end = std::chrono::system_clock::now();
-	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
-	
-	return ret;
+// Products of delta and the input over own units. In the per map layout each
+// thread takes an output map and accumulates a run of it against the runs of
+// the input maps of its group in 8 partial sums, so that the loop runs on vectors.
+void Convolutional::calc_gradient_pointwise ( const std::vector<Mat>& U, const std::vector<Mat>& delta, std::vector<std::vector<Mat>>& nabla )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int Cg = prev_num_map/groups, Og = num_map/groups;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	if( is_interleaved ){
+		const int B = U[0].m/prev_num_unit;
+		double* nabla_mat = workspace->get(0, (long long)Cg*num_map);
+		for( int g = 0; g < groups; ++g )
+			gemm_tn(Cg, Og, my_size*B, &U[0](my_offset*B, g*Cg), prev_num_map, &delta[0](my_offset*B, g*Og), num_map,
+					0.0, nabla_mat + (long long)g*Cg*Og, Og);
+		for( int i = 0; i < num_map; ++i ){
+			const int g = i/Og;
+			for( int j = 0; j < Cg; ++j )
+				nabla[i][j](0,0) = nabla_mat[(long long)(g*Cg + j)*Og + i - g*Og];
+		}
+	}
+	else{
+		const long long col_beg = (long long)my_offset*U[0].n, len = (long long)my_size*U[0].n;
+		const int chunk = (int)std::max(64LL, std::min(len, cache_size()/(16LL*(Cg + 1))));
+		// 4 output maps share the loads of an input map, each of them sums in 4 lanes.
+		const int Ob = (Og + 3)/4;
+#pragma omp parallel for
+		for( int q = 0; q < groups*Ob; ++q ){
+			const int g = q/Ob, o = g*Og + 4*(q%Ob), no = std::min(4, (g+1)*Og - o);
+			std::vector<double> acc(16*Cg, 0.0);
+			const double* d[4];
+			for( long long j0 = col_beg; j0 < col_beg + len; j0 += chunk ){
+				const int l = (int)std::min((long long)chunk, col_beg + len - j0);
+				for( int t = 0; t < 4; ++t ) d[t] = &delta[o + std::min(t, no-1)](0,0) + j0;
+				for( int c = 0; c < Cg; ++c ){
+					const double* x = &U[g*Cg + c](0,0) + j0;
+					double a[16];
+					for( int t = 0; t < 16; ++t ) a[t] = 0.0;
+					int k = 0;
+					for( ; k + 4 <= l; k += 4 )
+						for( int t = 0; t < 4; ++t ){
+							a[t] += d[0][k+t]*x[k+t]; a[4+t] += d[1][k+t]*x[k+t];
+							a[8+t] += d[2][k+t]*x[k+t]; a[12+t] += d[3][k+t]*x[k+t];
+						}
+					for( ; k < l; ++k ){
+						a[0] += d[0][k]*x[k]; a[4] += d[1][k]*x[k];
+						a[8] += d[2][k]*x[k]; a[12] += d[3][k]*x[k];
+					}
+					for( int t = 0; t < 16; ++t ) acc[16*c + t] += a[t];
+				}
+			}
+			for( int t = 0; t < no; ++t )
+				for( int c = 0; c < Cg; ++c ){
+					double sum = 0.0;
+					for( int s = 0; s < 4; ++s ) sum += acc[16*c + 4*t + s];
+					nabla[o+t][c](0,0) = sum;
+				}
+		}
+		cnt_flop += 2LL*len*Cg*num_map;
+	}
+
+	auto end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 }
 
 std::vector<std::vector<Convolutional::Vec>> Convolutional::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
@@ -679,7 +2594,7 @@ std::vector<std::vector<Convolutional::Vec>> Convolutional::apply ( const std::v
 					tmp[i](j,k) = u[k][i][j];
 	}
 	
-	auto U = apply(tmp, use_func);
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n);
 	for( int i = 0; i < U[0].n; ++i ) ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
 
@@ -696,31 +2611,61 @@ std::vector<std::vector<Convolutional::Vec>> Convolutional::apply ( const std::v
 	return ret;
 }
 
-std::vector<Convolutional::Mat> Convolutional::deconvolution ( const std::vector<Mat>& U )
+// Transposed convolution of the activated output with the bias taken off. It is
+// the product of calc_delta, so the GEMM and col2im of it are used with the
+// kernel of apply, the stride and the padding.
+std::vector<Convolutional::Mat> Convolutional::deconvolution ( const std::vector<Mat>& V )
 {
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
-	std::vector<Mat> ret(prev_num_map);
-
-#pragma omp parallel for           // @@@ add
-	for( int i = 0; i < prev_num_map; ++i ){
-		ret[i] = Mat(prev_num_unit, U[0].n);
-		for( int j = 0; j < num_map; ++j ){
-			auto U_ = (*func)(U[j], false);
-			for( int k = 0; k < U[0].n; ++k )
-				for( int x = 0; x < X; ++x )
-					for( int y = 0; y < Y; ++ y ){
-						for( int s = -m/2; s < (m+1)/2; ++s )
-							for( int t = -n/2; t < (n+1)/2; ++t ){
-								int nx = (x - s),
-									ny = (y - t);
-								if( nx < 0 || nx >= X || ny < 0 || ny >= Y ) continue;
-								nx /= stride; ny /= stride;
-								ret[i](x+prev_ldu*y,k) += W[j][i](s+m/2,t+n/2)*(U_(nx+ldu*ny,k) - bias[j]);
-							}
-					}
+	const int B = (is_interleaved ? V[0].m/num_unit : V[0].n);
+	int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+	const int width = (is_interleaved ? B*prev_num_map : B);
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*width;
+		offset[i] = i*prev_num_unit/nprocs*width;
+	}
+
+	my_offset = offset[rank] / width;
+	my_size = size[rank] / width;
+#endif
+
+	std::vector<Mat> U(V.size());
+	for( int i = 0; i < V.size(); ++i )
+		U[i] = (*func)(V[i], false);
+	if( is_use_bias && is_interleaved ){
+#pragma omp parallel for
+		for( int j = 0; j < U[0].m; ++j )
+			for( int i = 0; i < num_map; ++i )
+				U[0](j,i) -= bias[i];
+	}
+	else if( is_use_bias ){
+#pragma omp parallel
+		{
+			for( int i = 0; i < num_map; ++i )
+#pragma omp for nowait
+				for( int j = 0; j < U[0].m; ++j )
+					for( int k = 0; k < U[0].n; ++k )
+						U[i](j,k) -= bias[i];
 		}
 	}
 
+	if( is_pointwise() && kernel_delta.m == 0 ) build_kernel(true);
+	else if( !is_pointwise() && kernel_apply.m == 0 ) build_kernel(false);
+	std::vector<Mat> ret(is_interleaved ? 1 : prev_num_map, is_interleaved ? Mat(prev_num_unit*B, prev_num_map) : Mat(prev_num_unit, B));
+	if( is_pointwise() )
+		calc_delta_pointwise(U, ret, my_offset, my_size);
+	else if( is_interleaved )
+		calc_delta_interleaved(U[0], ret[0], my_offset, my_size);
+	else
+		calc_delta_im2col(U, ret, my_offset, my_size);
+
+#ifdef USE_MPI
+	for( int i = 0; i < ret.size(); ++i )
+		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+					   &ret[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+#endif
+
 	return ret;
 }
 
@@ -735,7 +2680,7 @@ std::vector<std::vector<Convolutional::Vec>> Convolutional::deconvolution ( cons
 			for( int k = 0; k < u.size(); ++k )
 				tmp[i](j,k) = u[k][i][j];
 	
-	auto U = deconvolution(tmp);
+	auto U = convert_layout(deconvolution(convert_layout(tmp, false, is_interleaved, num_unit)), is_interleaved, false, prev_num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n);
 	for( int i = 0; i < U[0].n; ++i ){
 		ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
@@ -749,7 +2694,73 @@ std::vector<std::vector<Convolutional::Vec>> Convolutional::deconvolution ( cons
 
 void Convolutional::set_once_num ( const int& once_num )
 {
-	this->once_num = once_num;
+	for( int i = 0; i < 3; ++i ){
+		this->once_num[i] = std::max(0, once_num);
+		once_cand[i].clear(); once_time[i].clear();
+	}
+}
+
+void Convolutional::set_once_budget ( const long long& bytes )
+{
+	once_budget = bytes;
+	set_once_num(0);
+}
+
+void Convolutional::set_algorithm ( const Algorithm& apply, const Algorithm& delta, const Algorithm& grad )
+{
+	algo_apply = apply;
+	algo_delta = delta;
+	algo_grad = grad;
+}
+
+void Convolutional::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+	clear_kernel();
+}
+
+void Convolutional::set_spatial ( const bool spatial )
+{
+	is_spatial = spatial;
+	if( spatial ) partition = UNIT;
+}
+
+// MAP suits layers of many maps on small images, whose maps are gathered after
+// apply and nx_delta is reduced over the ranks, while UNIT exchanges units.
+void Convolutional::set_partition ( const Partition& partition )
+{
+	this->partition = partition;
+	if( partition == MAP ) is_spatial = false;
+}
+
+#ifdef USE_MPI
+// The input rows under the output rows of own band, and for delta the output
+// rows over own input rows with own band of the gradient.
+void Convolutional::halo_range ( const bool is_delta, const int r, int& lo, int& hi )
+{
+	const int X = prev_ldu, Y = prev_num_unit/prev_ldu;
+	const int out_lo = r*num_unit/nprocs, out_hi = (r+1)*num_unit/nprocs;
+	if( !is_delta ){
+		lo = hi = 0;
+		if( out_lo == out_hi ) return;
+		const int ya = std::max(0, stride*(out_lo/ldu) - pad_top);
+		const int yb = std::min(Y, stride*((out_hi - 1)/ldu) + (m-1)*dilation_y - pad_top + 1);
+		if( ya < yb ){ lo = ya*X; hi = yb*X; }
+	}
+	else{
+		const int in_lo = r*prev_num_unit/nprocs, in_hi = (r+1)*prev_num_unit/nprocs;
+		int oa = 0, ob = 0;
+		if( in_lo != in_hi ) fft_delta_rows(in_lo/X, (in_hi - 1)/X + 1, oa, ob);
+		lo = out_lo; hi = out_hi;
+		if( oa < ob ){ lo = std::min(lo, oa*ldu); hi = std::max(hi, ob*ldu); }
+	}
+}
+#endif
+
+void Convolutional::set_W ( const std::vector<std::vector<Mat>>& W )
+{
+	this->W = W;
+	clear_kernel();
 }
 
 void Convolutional::set_W ( const std::string& filename )
@@ -757,7 +2768,7 @@ void Convolutional::set_W ( const std::string& filename )
 	std::ifstream ifs(filename, std::ios::binary);
 
 	for( int i = 0; i < num_map; ++i )
-		for( int j = 0; j < prev_num_map; ++j ){
+		for( int j = 0; j < W[i].size(); ++j ){
 			ifs.read((char*)&W[i][j].m, sizeof(W[i][j].m));
 			ifs.read((char*)&W[i][j].n, sizeof(W[i][j].n));
 	
@@ -779,6 +2790,7 @@ void Convolutional::set_W ( const std::string& filename )
 			}
 		}
 
+	clear_kernel();
 }
 
 void Convolutional::output_W ( const std::string& filename )
@@ -789,7 +2801,7 @@ void Convolutional::output_W ( const std::string& filename )
 		std::ofstream ofs(filename, std::ios::binary);
 		
 		for( int i = 0; i < num_map; ++i )
-			for( int j = 0; j < prev_num_map; ++j ){
+			for( int j = 0; j < W[i].size(); ++j ){
 				ofs.write((char*)&W[i][j].m, sizeof(W[i][j].m));
 				ofs.write((char*)&W[i][j].n, sizeof(W[i][j].n));
 				for( int k = 0; k < W[i][j].m; ++k )
@@ -862,6 +2874,7 @@ void Convolutional::param_mix ()
 			bias[i] = w[idx]/nprocs;
 		}
 	}
+	clear_kernel();
 }
 #endif
 
@@ -0,0 +1,539 @@
+#ifndef CONVOLUTIONALPOOLING_HPP
+#define CONVOLUTIONALPOOLING_HPP
+
+#include <fstream>
+#include "Layer.hpp"
+#include "Convolutional.hpp"
+
+// Convolutional followed by its activation and max pooling in one layer. The
+// convolution is computed by im2col for bands of pooled rows which fit the
+// cache, and only the pooled output is kept together with the argmax and the
+// pre-activation of each pooled unit, so that the backward passes touch only
+// the winners. The filters and the bias are held by conv, a Convolutional of
+// the same shape, so W is laid out as in Convolutional and its kernel, feed_idx,
+// im2col and update are shared with it.
+class ConvolutionalPooling : public Layer
+{
+private:
+	int prev_ldu, ldu;
+	int conv_num_unit, conv_ldu;
+	int m, n;
+	int pool_m, pool_n, pool_stride;
+	std::shared_ptr<Function> conv_func;
+	// conv covers all convolution units on every rank, so that its feed_idx
+	// serves the winners of any pooled unit.
+	std::shared_ptr<Convolutional> conv;
+
+	// S[i][j*B + b] is the convolution output unit which won the pooled unit
+	// my_offset + j of the map i for the sample b, Z[i](j, b) is its value before
+	// the activation. Both cover own pooled units of the last apply.
+	std::vector<std::vector<int>> S;
+	std::vector<Mat> Z;
+
+	void setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+				 int num_map, int conv_num_unit, int conv_ldu,
+				 int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+				 const std::shared_ptr<Function>& conv_f,
+				 int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+				 const std::shared_ptr<Function>& f, bool use_bias );
+	std::vector<Mat> winner_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta, const int my_offset, const int my_size );
+public:
+	// padding of m/2 and n/2 on each side.
+	ConvolutionalPooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+						  int num_map, int conv_num_unit, int conv_ldu,
+						  int m, int n, int stride,
+						  const std::shared_ptr<Function>& conv_f,
+						  int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+						  const std::shared_ptr<Function>& f, bool use_bias = true );
+	ConvolutionalPooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+						  int num_map, int conv_num_unit, int conv_ldu,
+						  int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+						  const std::shared_ptr<Function>& conv_f,
+						  int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+						  const std::shared_ptr<Function>& f, bool use_bias = true );
+
+#ifdef USE_MPI
+	void init( std::mt19937& mt, MPI_Comm inner_world, MPI_Comm outer_world );
+#else
+	void init( std::mt19937& mt );
+#endif
+	void finalize();
+
+	std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	void update_W ( const std::vector<std::vector<Mat>>& dW );
+
+	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
+	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
+
+	std::vector<std::vector<Mat>> get_W ();
+	void set_W ( const std::vector<std::vector<Mat>>& W );
+	void set_W ( const std::string& filename );
+	void output_W ( const std::string& filename );
+
+#ifdef USE_MPI
+	void param_mix ();
+#endif
+};
+
+ConvolutionalPooling::ConvolutionalPooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+											int num_map, int conv_num_unit, int conv_ldu,
+											int m, int n, int stride,
+											const std::shared_ptr<Function>& conv_f,
+											int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+											const std::shared_ptr<Function>& f, bool use_bias )
+{
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, conv_num_unit, conv_ldu,
+		  m, n, stride, m/2, m/2, n/2, n/2, conv_f, num_unit, ldu, pool_m, pool_n, pool_stride, f, use_bias);
+}
+
+ConvolutionalPooling::ConvolutionalPooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+											int num_map, int conv_num_unit, int conv_ldu,
+											int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+											const std::shared_ptr<Function>& conv_f,
+											int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+											const std::shared_ptr<Function>& f, bool use_bias )
+{
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, conv_num_unit, conv_ldu,
+		  m, n, stride, pad_top, pad_bottom, pad_left, pad_right, conv_f, num_unit, ldu, pool_m, pool_n, pool_stride, f, use_bias);
+}
+
+void ConvolutionalPooling::setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+								   int num_map, int conv_num_unit, int conv_ldu,
+								   int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+								   const std::shared_ptr<Function>& conv_f,
+								   int num_unit, int ldu, int pool_m, int pool_n, int pool_stride,
+								   const std::shared_ptr<Function>& f, bool use_bias )
+{
+	this->prev_num_map = prev_num_map;
+	this->prev_num_unit = prev_num_unit;
+	this->prev_ldu = prev_ldu;
+
+	this->num_map = num_map;
+	this->conv_num_unit = conv_num_unit;
+	this->conv_ldu = conv_ldu;
+	this->num_unit = num_unit;
+	this->ldu = ldu;
+
+	t_apply = t_delta = t_grad = 0.0;
+	t_apply_init = t_apply_gemm = t_apply_repl = t_apply_comm = 0.0;
+	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
+	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
+
+	this->m = m; this->n = n;
+	this->pool_m = pool_m; this->pool_n = pool_n; this->pool_stride = pool_stride;
+
+	int rank = 0;
+#ifdef USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	if( conv_num_unit%conv_ldu != 0 || num_unit%ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of output on ConvolutionPooling layer.\n");
+			printf("          Layer details : convolution size[%d x %d], output size[%d x %d], number of map %d.\n", conv_num_unit/conv_ldu, conv_ldu, num_unit/ldu, ldu, num_map);
+		}
+	if( prev_num_unit%prev_ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of input on ConvolutionPooling layer.\n");
+			printf("          Layer details : convolution size[%d x %d], output size[%d x %d], number of map %d.\n", conv_num_unit/conv_ldu, conv_ldu, num_unit/ldu, ldu, num_map);
+		}
+	if( ldu != (conv_ldu - pool_n)/pool_stride + 1 || num_unit/ldu != (conv_num_unit/conv_ldu - pool_m)/pool_stride + 1 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong output image size on ConvolutionPooling layer.\n");
+			printf("          Estimate size = [%d x %d].\n", (conv_num_unit/conv_ldu - pool_m)/pool_stride + 1, (conv_ldu - pool_n)/pool_stride + 1);
+			printf("          Layer details : pooling size[%d x %d], stride %d, number of map %d.\n", pool_m, pool_n, pool_stride, num_map);
+		}
+
+	this->conv_func = conv_f;
+	func = f;
+
+	// the size of the convolution image is checked by conv.
+	conv = std::make_shared<Convolutional>(prev_num_map, prev_num_unit, prev_ldu, num_map, conv_num_unit, conv_ldu,
+										   m, n, stride, pad_top, pad_bottom, pad_left, pad_right, conv_f, use_bias);
+}
+
+#ifdef USE_MPI
+void ConvolutionalPooling::init ( std::mt19937& mt, MPI_Comm inner_world, MPI_Comm outer_world )
+#else
+void ConvolutionalPooling::init ( std::mt19937& mt )
+#endif
+{
+#ifdef USE_MPI
+	this->inner_world = inner_world;
+	this->outer_world = outer_world;
+
+	MPI_Comm_rank(inner_world, &rank);
+	MPI_Comm_size(inner_world, &nprocs);
+#endif
+
+	if( !this->initial_value_range_default )
+		conv->set_initial_value_range(this->initial_value_range[0], this->initial_value_range[1]);
+#ifdef USE_MPI
+	conv->init(mt, MPI_COMM_SELF, outer_world);
+#else
+	conv->init(mt);
+#endif
+}
+
+void ConvolutionalPooling::finalize ()
+{
+}
+
+// delta of own pooled units multiplied by the derivative of the activation at
+// their winners, which is the only nonzero delta of the convolution output.
+// The winners are found again if the last apply was of another mini-batch.
+std::vector<ConvolutionalPooling::Mat> ConvolutionalPooling::winner_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta, const int my_offset, const int my_size )
+{
+	const int B = delta[0].n;
+	if( S.size() != num_map || S[0].size() != (long long)my_size*B ){
+		std::vector<Mat> V(U.size());
+		for( int c = 0; c < U.size(); ++c ) V[c] = (*prev_func)(U[c], false);
+		apply(V, false);
+	}
+
+	std::vector<Mat> G(num_map);
+	for( int i = 0; i < num_map; ++i ){
+		G[i] = (*conv_func)(Z[i], true);
+#pragma omp parallel for
+		for( int j = 0; j < my_size; ++j )
+			for( int b = 0; b < B; ++b )
+				G[i](j, b) *= delta[i](my_offset + j, b);
+	}
+	return G;
+}
+
+// Each thread takes an output map and accumulates its filters over the winners
+// of own pooled units, so that the cost is that of the pooled output. The input
+// is transposed so that the maps of a unit of a sample are contiguous.
+std::vector<std::vector<ConvolutionalPooling::Mat>> ConvolutionalPooling::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int mn = m*n, C = prev_num_map, B = delta[0].n;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	// winner_delta may run apply, which uses the workspace, before Ut is taken.
+	const std::vector<Mat> G = winner_delta(U, delta, my_offset, my_size);
+	std::vector<std::vector<Mat>> nabla(num_map, std::vector<Mat>(C, Mat(m, n)));
+	double* Ut = workspace->get(0, (long long)B*prev_num_unit*C);
+	for( int c = 0; c < C; ++c ){
+		const Mat U_ = (*prev_func)(U[c], false);
+#pragma omp parallel for
+		for( int k = 0; k < prev_num_unit; ++k )
+			for( int b = 0; b < B; ++b )
+				Ut[((long long)b*prev_num_unit + k)*C + c] = U_(k, b);
+	}
+	const int* feed_idx = conv->get_feed_idx();
+	Vec& d_bias = conv->d_bias;
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i ){
+		std::vector<double> acc(mn*C, 0.0);
+		double sum = 0.0;
+		for( int j = 0; j < my_size; ++j )
+			for( int b = 0; b < B; ++b ){
+				const double g = G[i](j, b);
+				const int* feed = feed_idx + (long long)S[i][j*B + b]*mn;
+				const double* u = &Ut[(long long)b*prev_num_unit*C];
+				sum += g;
+				for( int q = 0; q < mn; ++q ){
+					if( feed[q] == -1 ) continue;
+
+					const double* x = u + (long long)feed[q]*C;
+					double* a = &acc[q*C];
+					for( int c = 0; c < C; ++c ) a[c] += g*x[c];
+				}
+			}
+
+		// the tap q = t*n + s is the element (s, t) of W as in build_kernel.
+		for( int q = 0; q < mn; ++q )
+			for( int c = 0; c < C; ++c )
+				nabla[i][c](q%n, q/n) = acc[q*C + c];
+		d_bias[i] = sum;
+	}
+	cnt_flop += 2LL*my_size*mn*C*num_map*B;
+	end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	for( int i = 0; i < num_map; ++i )
+		for( int j = 0; j < C; ++j )
+			MPI_Allreduce(MPI_IN_PLACE, &nabla[i][j](0,0), mn, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+	MPI_Allreduce(MPI_IN_PLACE, &d_bias[0], num_map, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_grad_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nabla;
+}
+
+// Each thread takes samples and adds the filters scaled by delta of the winners
+// of own pooled units into a buffer of the sample, whose maps of a unit are
+// contiguous, and stores it into nx_delta at the end.
+std::vector<ConvolutionalPooling::Mat> ConvolutionalPooling::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int mn = m*n, C = prev_num_map, B = delta[0].n;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	// w[(i*mn + q)*C + c] is the tap q from the input map c to the map i.
+	if( conv->kernel_apply.m == 0 ) conv->build_kernel(false);
+	const Mat& kernel = conv->kernel_apply;
+	std::vector<double> w(num_map*mn*C);
+	for( int i = 0; i < num_map; ++i )
+		for( int q = 0; q < mn; ++q )
+			for( int c = 0; c < C; ++c )
+				w[(i*mn + q)*C + c] = kernel(c*mn + q, i);
+	const std::vector<Mat> G = winner_delta(U, delta, my_offset, my_size);
+	const int* feed_idx = conv->get_feed_idx();
+	std::vector<Mat> nx_delta(C, Mat(prev_num_unit, B));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel
+	{
+		std::vector<double> acc(prev_num_unit*C);
+#pragma omp for
+		for( int b = 0; b < B; ++b ){
+			std::fill(acc.begin(), acc.end(), 0.0);
+			for( int i = 0; i < num_map; ++i )
+				for( int j = 0; j < my_size; ++j ){
+					const double g = G[i](j, b);
+					const int* feed = feed_idx + (long long)S[i][j*B + b]*mn;
+					for( int q = 0; q < mn; ++q ){
+						if( feed[q] == -1 ) continue;
+
+						const double* wq = &w[(i*mn + q)*C];
+						double* a = &acc[feed[q]*C];
+						for( int c = 0; c < C; ++c ) a[c] += wq[c]*g;
+					}
+				}
+
+			for( int k = 0; k < prev_num_unit; ++k )
+				for( int c = 0; c < C; ++c )
+					nx_delta[c](k, b) = acc[k*C + c];
+		}
+	}
+	cnt_flop += 2LL*my_size*mn*C*num_map*B;
+	end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	for( int c = 0; c < C; ++c )
+		MPI_Allreduce(MPI_IN_PLACE, &nx_delta[c](0,0), prev_num_unit*B, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	for( int c = 0; c < C; ++c )
+		nx_delta[c] = Mat::hadamard(nx_delta[c], (*prev_func)(U[c], true));
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+// d_bias of conv is set by calc_gradient.
+void ConvolutionalPooling::update_W ( const std::vector<std::vector<Mat>>& dW )
+{
+	conv->update_W(dW);
+}
+
+// Own pooled units are taken in bands of pooled rows and chunks of the
+// mini-batch. The convolution rows under a band are computed by im2col and GEMM
+// into a tile which fits the cache, activated and pooled from there.
+std::vector<ConvolutionalPooling::Mat> ConvolutionalPooling::apply ( const std::vector<Mat>& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int mn = m*n, C = prev_num_map, rows = mn*C, B = U[0].n;
+	const int CY = conv_num_unit/conv_ldu;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*B;
+		offset[i] = i*num_unit/nprocs*B;
+	}
+
+	my_offset = offset[rank] / B;
+	my_size = size[rank] / B;
+#endif
+
+	// rows of the kernel of conv are the rows of im2col.
+	if( conv->kernel_apply.m == 0 ) conv->build_kernel(false);
+	const Mat& kernel = conv->kernel_apply;
+	const Vec& bias = conv->bias;
+
+	std::vector<Mat> ret(num_map, Mat(num_unit, B));
+	S = std::vector<std::vector<int>>(num_map, std::vector<int>(my_size*B));
+	Z = std::vector<Mat>(num_map, Mat(my_size, B));
+
+	// a pooled row needs pool_m convolution rows, and a chunk of the mini-batch
+	// and a band of pooled rows are chosen so that the tile fits the cache.
+	const long long unit_bytes = 8LL*(rows + 2*num_map);
+	const int once = (int)std::max(1LL, std::min((long long)B, Convolutional::cache_size()/(unit_bytes*pool_m*conv_ldu)));
+	const int band = (int)std::max(1LL, Convolutional::cache_size()/(unit_bytes*pool_m*conv_ldu*once));
+	const int max_rows = (band - 1)*pool_stride + pool_m;
+	double* image = workspace->get(0, (long long)rows*max_rows*conv_ldu*once);
+	Mat tile;
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	const int py_beg = (my_size == 0 ? 0 : my_offset/ldu), py_end = (my_size == 0 ? 0 : (my_offset + my_size - 1)/ldu + 1);
+	for( int i = 0; i < B; i += once ){
+		const int bc = std::min(once, B - i);
+
+		for( int py0 = py_beg; py0 < py_end; py0 += band ){
+			const int py1 = std::min(py_end, py0 + band);
+			const int cy0 = py0*pool_stride, cy1 = std::min(CY, (py1 - 1)*pool_stride + pool_m);
+			const int nu = (cy1 - cy0)*conv_ldu, ld = nu*bc;
+
+			beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+			for( int r = 0; r < rows; ++r )
+				conv->im2col_runs(U[r/mn], r%mn, cy0*conv_ldu, nu, i, bc, image + (long long)r*ld);
+			end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			tile = Mat(num_map, ld);
+			gemm_tn(num_map, ld, rows, &kernel(0,0), num_map, image, ld, 0.0, &tile(0,0), ld);
+			if( conv->is_use_bias ){
+#pragma omp parallel for
+				for( int k = 0; k < num_map; ++k )
+					for( int l = 0; l < ld; ++l ) tile(k, l) += bias[k];
+			}
+			const Mat act = (*conv_func)(tile, false);
+			end = std::chrono::system_clock::now();
+			t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+			beg = std::chrono::system_clock::now();
+			const int j0 = std::max(my_offset, py0*ldu), j1 = std::min(my_offset + my_size, py1*ldu);
+#pragma omp parallel for
+			for( int r = 0; r < num_map*(j1 - j0); ++r ){
+				const int k = r/(j1 - j0), j = j0 + r%(j1 - j0);
+				const int px = j%ldu, py = j/ldu;
+				for( int b = 0; b < bc; ++b ){
+					int s_idx = -1;
+					double val = 0.0;
+					for( int t = 0; t < pool_m; ++t ){
+						const int cy = py*pool_stride + t;
+						if( cy >= cy1 ) continue;
+						for( int s = 0; s < pool_n; ++s ){
+							const int cx = px*pool_stride + s;
+							if( cx >= conv_ldu ) continue;
+
+							const int u = (cy - cy0)*conv_ldu + cx;
+							if( s_idx == -1 || val < act(k, u*bc + b) ){
+								val = act(k, u*bc + b);
+								s_idx = u;
+							}
+						}
+					}
+
+					ret[k](j, i + b) = val;
+					Z[k](j - my_offset, i + b) = tile(k, s_idx*bc + b);
+					S[k][(j - my_offset)*B + i + b] = cy0*conv_ldu + s_idx;
+				}
+			}
+			end = std::chrono::system_clock::now();
+			t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+		}
+	}
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	for( int k = 0; k < num_map; ++k )
+		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+					   &ret[k](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	if( use_func )
+		for( int k = 0; k < num_map; ++k )
+			ret[k] = (*func)(ret[k], false);
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return ret;
+}
+
+std::vector<std::vector<ConvolutionalPooling::Vec>> ConvolutionalPooling::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
+{
+	std::vector<Mat> tmp(prev_num_map, Mat(u[0][0].size(), u.size()));
+#pragma omp parallel
+	{
+		for( int i = 0; i < prev_num_map; ++i )
+#pragma omp for nowait
+			for( int j = 0; j < u[0][0].size(); ++j )
+				for( int k = 0; k < u.size(); ++k )
+					tmp[i](j,k) = u[k][i][j];
+	}
+
+	auto U = apply(tmp, use_func);
+	std::vector<std::vector<Vec>> ret(U[0].n, std::vector<Vec>(U.size(), Vec(U[0].m)));
+#pragma omp parallel
+	{
+		for( int i = 0; i < U[0].n; ++i ){
+#pragma omp for nowait
+			for( int j = 0; j < U.size(); ++j )
+				for( int k = 0; k < U[0].m; ++k )
+					ret[i][j][k] = U[j](k,i);
+		}
+	}
+
+	return ret;
+}
+
+std::vector<std::vector<ConvolutionalPooling::Mat>> ConvolutionalPooling::get_W ()
+{
+	return conv->get_W();
+}
+
+void ConvolutionalPooling::set_W ( const std::vector<std::vector<Mat>>& W )
+{
+	conv->set_W(W);
+}
+
+void ConvolutionalPooling::set_W ( const std::string& filename )
+{
+	conv->set_W(filename);
+}
+
+void ConvolutionalPooling::output_W ( const std::string& filename )
+{
+	conv->output_W(filename);
+}
+
+#ifdef USE_MPI
+void ConvolutionalPooling::param_mix ()
+{
+	conv->param_mix();
+}
+#endif
+
+#endif
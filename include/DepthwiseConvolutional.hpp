@@ -0,0 +1,524 @@
+#ifndef DEPTHWISECONVOLUTIONAL_HPP
+#define DEPTHWISECONVOLUTIONAL_HPP
+
+#include <fstream>
+#include "Layer.hpp"
+
+// Convolution of each input map by its own filters. The output maps c*K, ...,
+// c*K + K - 1 come from the input map c where K = num_map/prev_num_map, so
+// W[i] has a single filter, W[i][0](s, t) is its element at the row t and the
+// column s as in Convolutional. Followed by a Convolutional of 1 x 1 filters as
+// the pointwise stage, it is the depthwise separable convolution.
+class DepthwiseConvolutional : public Layer
+{
+private:
+	int prev_ldu, ldu;
+	int m, n, stride;
+	int pad_top, pad_bottom, pad_left, pad_right;
+
+	// feed_idx[j*m*n + t*n + s] is the input unit under the filter element (t, s)
+	// of own output unit j, or -1 on the padding.
+	std::vector<int> feed_idx;
+
+	void setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+				 int num_map, int num_unit, int ldu,
+				 int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+				 const std::shared_ptr<Function>& f, bool use_bias );
+
+	Vec r, v;
+	double beta_, gamma_;
+public:
+	Vec bias, d_bias;
+	// padding of m/2 and n/2 on each side.
+	DepthwiseConvolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+							int num_map, int num_unit, int ldu,
+							int m, int n, int stride,
+							const std::shared_ptr<Function>& f, bool use_bias = true );
+	DepthwiseConvolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+							int num_map, int num_unit, int ldu,
+							int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+							const std::shared_ptr<Function>& f, bool use_bias = true );
+
+#ifdef USE_MPI
+	void init( std::mt19937& mt, MPI_Comm inner_world, MPI_Comm outer_world );
+#else
+	void init( std::mt19937& mt );
+#endif
+	void finalize();
+
+	std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	void update_W ( const std::vector<std::vector<Mat>>& dW );
+
+	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
+	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
+
+	void set_W ( const std::string& filename );
+	void output_W ( const std::string& filename );
+
+#ifdef USE_MPI
+	void param_mix ();
+#endif
+};
+
+DepthwiseConvolutional::DepthwiseConvolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+												int num_map, int num_unit, int ldu,
+												int m, int n, int stride,
+												const std::shared_ptr<Function>& f, bool use_bias )
+{
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu,
+		  m, n, stride, m/2, m/2, n/2, n/2, f, use_bias);
+}
+
+DepthwiseConvolutional::DepthwiseConvolutional( int prev_num_map, int prev_num_unit, int prev_ldu,
+												int num_map, int num_unit, int ldu,
+												int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+												const std::shared_ptr<Function>& f, bool use_bias )
+{
+	setup(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu,
+		  m, n, stride, pad_top, pad_bottom, pad_left, pad_right, f, use_bias);
+}
+
+void DepthwiseConvolutional::setup ( int prev_num_map, int prev_num_unit, int prev_ldu,
+									 int num_map, int num_unit, int ldu,
+									 int m, int n, int stride, int pad_top, int pad_bottom, int pad_left, int pad_right,
+									 const std::shared_ptr<Function>& f, bool use_bias )
+{
+	this->prev_num_map = prev_num_map;
+	this->prev_num_unit = prev_num_unit;
+	this->prev_ldu = prev_ldu;
+
+	this->num_map = num_map;
+	this->num_unit = num_unit;
+	this->ldu = ldu;
+
+	this->is_use_bias = use_bias;
+
+	t_apply = t_delta = t_grad = 0.0;
+	t_apply_init = t_apply_gemm = t_apply_repl = t_apply_comm = 0.0;
+	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
+	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
+
+	this->m = m; this->n = n; this->stride = stride;
+	this->pad_top = pad_top; this->pad_bottom = pad_bottom;
+	this->pad_left = pad_left; this->pad_right = pad_right;
+
+	int rank = 0;
+#ifdef USE_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+	if( num_map%prev_num_map != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Number of output maps is not a multiple of input maps on DepthwiseConvolution layer.\n");
+			printf("          Layer details : input maps %d, output maps %d.\n", prev_num_map, num_map);
+		}
+	if( num_unit%ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of output on DepthwiseConvolution layer.\n");
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
+		}
+	if( prev_num_unit%prev_ldu != 0 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong leading dimension of input on DepthwiseConvolution layer.\n");
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
+		}
+	if( ldu != (prev_ldu + pad_left + pad_right - n)/stride + 1 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong output image width on DepthwiseConvolution layer.\n");
+			printf("          Estimate width = %d.\n", (prev_ldu + pad_left + pad_right - n)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
+		}
+	if( num_unit/ldu != (prev_num_unit/prev_ldu + pad_top + pad_bottom - m)/stride + 1 )
+		if( rank == 0 ){
+			printf("WARNING : Wrong output image height on DepthwiseConvolution layer.\n");
+			printf("          Estimate height = %d.\n", (prev_num_unit/prev_ldu + pad_top + pad_bottom - m)/stride + 1);
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding [%d %d %d %d], number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad_top, pad_bottom, pad_left, pad_right, num_map);
+		}
+
+	func = f;
+
+	beta_ = 1.0; gamma_ = 1.0;
+	W = std::vector<std::vector<Mat>>(num_map, std::vector<Mat>(1, Mat(n, m)));
+}
+
+#ifdef USE_MPI
+void DepthwiseConvolutional::init ( std::mt19937& mt, MPI_Comm inner_world, MPI_Comm outer_world )
+#else
+void DepthwiseConvolutional::init ( std::mt19937& mt )
+#endif
+{
+#ifdef USE_MPI
+	this->inner_world = inner_world;
+	this->outer_world = outer_world;
+
+	MPI_Comm_rank(inner_world, &rank);
+	MPI_Comm_size(inner_world, &nprocs);
+#endif
+
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	feed_idx.resize(my_size*m*n);
+#pragma omp parallel for
+	for( int i = 0; i < my_size; ++i ){
+		int x = (i + my_offset)%ldu, y = (i + my_offset)/ldu;
+		for( int t = 0; t < m; ++t )
+			for( int s = 0; s < n; ++s ){
+				int nx = stride*x + s - pad_left, ny = stride*y + t - pad_top;
+				feed_idx[i*m*n + t*n + s] = (nx < 0 || nx >= X || ny < 0 || ny >= Y ? -1 : ny*prev_ldu + nx);
+			}
+	}
+
+	double up = 0.1;
+	double low = 0.0;
+	if (!this->initial_value_range_default)
+	{
+		low = this->initial_value_range[0];
+		up  = this->initial_value_range[1];
+	}
+	std::normal_distribution<double> d_rand(low, up);
+
+	bias = Vec(num_map, 0.0); d_bias = Vec(num_map, 0.0);
+	this->r = Vec(num_map, 0.0); v = Vec(num_map, 0.0);
+	for( int i = 0; i < num_map; ++i )
+		for( int k = 0; k < n; ++k )
+			for( int l = 0; l < m; ++l )
+				W[i][0](k,l) = d_rand(mt);
+
+	for( int i = 0; i < num_map; ++i ) bias[i] = d_rand(mt);
+}
+
+void DepthwiseConvolutional::finalize ()
+{
+}
+
+// Each thread takes an output map and a filter element, and accumulates it over
+// own output units along the contiguous mini-batch.
+std::vector<std::vector<DepthwiseConvolutional::Mat>> DepthwiseConvolutional::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int mn = m*n, K = num_map/prev_num_map, B = delta[0].n;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+
+	std::vector<std::vector<Mat>> nabla(num_map, std::vector<Mat>(1, Mat(n, m)));
+	std::vector<Mat> U_(U.size());
+	for( int i = 0; i < U.size(); ++i )
+		U_[i] = (*prev_func)(U[i], false);
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int r = 0; r < num_map*mn; ++r ){
+		const int i = r/mn, q = r%mn;
+		double sum = 0.0;
+		for( int j = 0; j < my_size; ++j ){
+			const int idx = feed_idx[j*mn + q];
+			if( idx == -1 ) continue;
+
+			const double* d = &delta[i](my_offset + j, 0);
+			const double* x = &U_[i/K](idx, 0);
+			for( int b = 0; b < B; ++b ) sum += d[b]*x[b];
+		}
+		nabla[i][0](q%n, q/n) = sum;
+	}
+	cnt_flop += 2LL*my_size*mn*num_map*B;
+	end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	if( is_use_bias ){
+		for( int i = 0; i < num_map; ++i ){
+			double sum = 0.0;
+#pragma omp parallel for reduction(+:sum)
+			for( int k = 0; k < delta[i].m; ++k )
+				for( int j = 0; j < delta[i].n; ++j )
+					sum += delta[i](k, j);
+
+			d_bias[i] = sum;
+		}
+	}
+	end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	for( int i = 0; i < num_map; ++i )
+		MPI_Allreduce(MPI_IN_PLACE, &nabla[i][0](0,0), mn, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_grad_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nabla;
+}
+
+// Each thread takes one own input unit of an input map and gathers delta of the
+// output units which use it, so that every value is written once.
+std::vector<DepthwiseConvolutional::Mat> DepthwiseConvolutional::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int K = num_map/prev_num_map, B = delta[0].n;
+	const int X = prev_ldu, OY = num_unit/ldu;
+	int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*prev_num_unit/nprocs - i*prev_num_unit/nprocs)*B;
+		offset[i] = i*prev_num_unit/nprocs*B;
+	}
+
+	my_offset = offset[rank] / B;
+	my_size = size[rank] / B;
+#endif
+
+	std::vector<Mat> nx_delta(prev_num_map, Mat(prev_num_unit, B));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int r = 0; r < prev_num_map*my_size; ++r ){
+		const int c = r/my_size, p = my_offset + r%my_size;
+		const int x = p%X, y = p/X;
+		double* v = &nx_delta[c](p, 0);
+		std::fill(v, v + B, 0.0);
+
+		for( int t = 0; t < m; ++t ){
+			int oy = y + pad_top - t;
+			if( oy < 0 || oy%stride != 0 || oy/stride >= OY ) continue;
+			oy /= stride;
+			for( int s = 0; s < n; ++s ){
+				int ox = x + pad_left - s;
+				if( ox < 0 || ox%stride != 0 || ox/stride >= ldu ) continue;
+				ox /= stride;
+
+				for( int l = 0; l < K; ++l ){
+					const double w = W[c*K + l][0](s, t);
+					const double* d = &delta[c*K + l](oy*ldu + ox, 0);
+					for( int b = 0; b < B; ++b ) v[b] += w*d[b];
+				}
+			}
+		}
+	}
+	cnt_flop += 2LL*my_size*m*n*num_map*B;
+	end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	for( int i = 0; i < prev_num_map; ++i )
+		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+					   &nx_delta[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	for( int i = 0; i < prev_num_map; ++i )
+		nx_delta[i] = Mat::hadamard(nx_delta[i], (*prev_func)(U[i], true));
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+void DepthwiseConvolutional::update_W ( const std::vector<std::vector<Mat>>& dW )
+{
+	const double a_beta = 0.9, a_gamma = 0.999, a_eps = 1.0E-8;
+	beta_ *= a_beta; gamma_ *= a_gamma;
+	for( int i = 0; i < num_map; ++i ){
+		W[i][0] += dW[i][0];
+
+		if( is_use_bias ){
+			v[i] = a_beta*v[i] + (1.0 - a_beta)*d_bias[i];
+			r[i] = a_gamma*r[i] + (1.0 - a_gamma)*d_bias[i]*d_bias[i];
+			bias[i] -= 0.001*v[i]/(1.0 - beta_)/(sqrt(r[i]/(1.0 - gamma_)+a_eps));
+		}
+	}
+}
+
+// Each thread takes one own output unit of an input map and computes its K
+// output maps, the innermost loop runs along the contiguous mini-batch.
+std::vector<DepthwiseConvolutional::Mat> DepthwiseConvolutional::apply ( const std::vector<Mat>& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int mn = m*n, K = num_map/prev_num_map, B = U[0].n;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*B;
+		offset[i] = i*num_unit/nprocs*B;
+	}
+
+	my_offset = offset[rank] / B;
+	my_size = size[rank] / B;
+#endif
+
+	std::vector<Mat> ret(num_map, Mat(num_unit, B));
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int r = 0; r < prev_num_map*my_size; ++r ){
+		const int c = r/my_size, j = r%my_size;
+		for( int l = 0; l < K; ++l ){
+			double* v = &ret[c*K + l](my_offset + j, 0);
+			std::fill(v, v + B, is_use_bias ? bias[c*K + l] : 0.0);
+		}
+
+		for( int q = 0; q < mn; ++q ){
+			const int idx = feed_idx[j*mn + q];
+			if( idx == -1 ) continue;
+
+			const double* x = &U[c](idx, 0);
+			for( int l = 0; l < K; ++l ){
+				const double w = W[c*K + l][0](q%n, q/n);
+				double* v = &ret[c*K + l](my_offset + j, 0);
+				for( int b = 0; b < B; ++b ) v[b] += w*x[b];
+			}
+		}
+	}
+	cnt_flop += 2LL*my_size*mn*num_map*B;
+	end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	for( int i = 0; i < num_map; ++i )
+		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+					   &ret[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	if( use_func )
+		for( int i = 0; i < num_map; ++i )
+			ret[i] = (*func)(ret[i], false);
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return ret;
+}
+
+std::vector<std::vector<DepthwiseConvolutional::Vec>> DepthwiseConvolutional::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
+{
+	std::vector<Mat> tmp(prev_num_map, Mat(u[0][0].size(), u.size()));
+#pragma omp parallel
+	{
+		for( int i = 0; i < prev_num_map; ++i )
+#pragma omp for nowait
+			for( int j = 0; j < u[0][0].size(); ++j )
+				for( int k = 0; k < u.size(); ++k )
+					tmp[i](j,k) = u[k][i][j];
+	}
+
+	auto U = apply(tmp, use_func);
+	std::vector<std::vector<Vec>> ret(U[0].n, std::vector<Vec>(U.size(), Vec(U[0].m)));
+#pragma omp parallel
+	{
+		for( int i = 0; i < U[0].n; ++i ){
+#pragma omp for nowait
+			for( int j = 0; j < U.size(); ++j )
+				for( int k = 0; k < U[0].m; ++k )
+					ret[i][j][k] = U[j](k,i);
+		}
+	}
+
+	return ret;
+}
+
+void DepthwiseConvolutional::set_W ( const std::string& filename )
+{
+	std::ifstream ifs(filename, std::ios::binary);
+
+	for( int i = 0; i < num_map; ++i ){
+		ifs.read((char*)&W[i][0].m, sizeof(W[i][0].m));
+		ifs.read((char*)&W[i][0].n, sizeof(W[i][0].n));
+		for( int k = 0; k < W[i][0].m; ++k )
+			for( int l = 0; l < W[i][0].n; ++l )
+				ifs.read((char*)&W[i][0](k,l), sizeof(W[i][0](k,l)));
+	}
+
+	ifs.read((char*)&is_use_bias, sizeof(is_use_bias));
+	if( is_use_bias ){
+		int sz = 0;
+		ifs.read((char*)&sz, sizeof(int));
+		bias.resize(sz);
+		for( int i = 0; i < sz; ++i )
+			ifs.read((char*)&bias[i], sizeof(bias[i]));
+	}
+}
+
+void DepthwiseConvolutional::output_W ( const std::string& filename )
+{
+#ifdef USE_MPI
+	if( rank == 0 ){
+#endif
+		std::ofstream ofs(filename, std::ios::binary);
+
+		for( int i = 0; i < num_map; ++i ){
+			ofs.write((char*)&W[i][0].m, sizeof(W[i][0].m));
+			ofs.write((char*)&W[i][0].n, sizeof(W[i][0].n));
+			for( int k = 0; k < W[i][0].m; ++k )
+				for( int l = 0; l < W[i][0].n; ++l )
+					ofs.write((char*)&W[i][0](k,l), sizeof(W[i][0](k,l)));
+		}
+
+		ofs.write((char*)&is_use_bias, sizeof(is_use_bias));
+		if( is_use_bias ){
+			int sz = bias.size();
+			ofs.write((char*)&sz, sizeof(int));
+			for( int i = 0; i < sz; ++i )
+				ofs.write((char*)&bias[i], sizeof(bias[i]));
+		}
+#ifdef USE_MPI
+	}
+#endif
+}
+
+#ifdef USE_MPI
+void DepthwiseConvolutional::param_mix ()
+{
+	int nprocs;
+	MPI_Comm_size(outer_world, &nprocs);
+	if( W.size() == 0 ) return;
+
+	const int mn = m*n, cnt = num_map*mn + bias.size();
+	std::vector<double> w(cnt);
+
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i )
+		for( int q = 0; q < mn; ++q )
+			w[i*mn + q] = W[i][0](q%n, q/n);
+	for( int i = 0; i < bias.size(); ++i ) w[num_map*mn + i] = bias[i];
+
+	MPI_Allreduce(MPI_IN_PLACE, &w[0], cnt, MPI_DOUBLE_PRECISION, MPI_SUM, outer_world);
+
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i )
+		for( int q = 0; q < mn; ++q )
+			W[i][0](q%n, q/n) = w[i*mn + q]/nprocs;
+	for( int i = 0; i < bias.size(); ++i ) bias[i] = w[num_map*mn + i]/nprocs;
+}
+#endif
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef FFT_HPP
+#define FFT_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Mixed radix FFT of length n = 2^a 3^b 5^c by the Stockham algorithm.
+// Every point of the sequence is a block of len complex numbers stored as len
+// real parts followed by len imaginary parts, and all of them are transformed
+// at once so that the innermost loops run along the block.
+class FFT
+{
+	int n;
+	std::vector<int> radix, offset;
+	std::vector<double> twiddle, root;
+public:
+	FFT ( const int n = 1 );
+
+	int size () const { return n; }
+	static int good_size ( const int n, const bool is_even = false );
+
+	// x[i] for i < n is the block at x + i*ld, work needs 2*n*len doubles.
+	// The inverse transform is not normalized.
+	void transform ( double* x, const int ld, const int len, const bool inverse, double* work ) const;
+};
+
+// Two dimensional FFT of real images of P x Q, Q is even. An image is stored by
+// rows of Q/2 + 1 blocks, a row is packed in the first Q/2 blocks as the columns
+// 2j and 2j+1 in the real and imaginary parts of the block j, and the forward
+// transform replaces it by Q/2 + 1 frequencies of the row. The inverse transform
+// returns the packed image scaled by P*Q/2.
+class RealFFT2D
+{
+	int P, Q;
+	FFT row, col;
+	std::vector<double> twiddle;
+public:
+	RealFFT2D ( const int P = 1, const int Q = 2 );
+
+	int rows () const { return P; }
+	int cols () const { return Q; }
+	// work needs 2*max(P, Q/2)*len doubles.
+	void forward ( double* x, const int len, double* work ) const;
+	void inverse ( double* x, const int len, double* work ) const;
+};
+
+FFT::FFT ( const int n )
+{
+	const double PI = acos(-1.0);
+	this->n = n;
+
+	int r = n;
+	while( r%4 == 0 ){ radix.push_back(4); r /= 4; }
+	if( r%2 == 0 ){ radix.push_back(2); r /= 2; }
+	while( r%3 == 0 ){ radix.push_back(3); r /= 3; }
+	while( r%5 == 0 ){ radix.push_back(5); r /= 5; }
+	if( r != 1 ) printf("WARNING : Length of FFT %d has a prime factor other than 2, 3 and 5.\n", n);
+
+	// twiddle[offset[st] + 2*(j*R + r)] = exp(-2 pi i r j/(Ns R)) for j < Ns of the stage st.
+	int Ns = 1;
+	for( int st = 0; st < radix.size(); ++st ){
+		const int R = radix[st];
+		offset.push_back(twiddle.size());
+		for( int j = 0; j < Ns; ++j )
+			for( int r = 0; r < R; ++r ){
+				twiddle.push_back(cos(2.0*PI*r*j/(Ns*R)));
+				twiddle.push_back(-sin(2.0*PI*r*j/(Ns*R)));
+			}
+		Ns *= R;
+	}
+
+	// root[2*(5*r + q)] = exp(-2 pi i r q/5) and root[50 + 2*(3*r + q)] = exp(-2 pi i r q/3).
+	root.resize(68);
+	for( int r = 0; r < 5; ++r )
+		for( int q = 0; q < 5; ++q ){
+			root[2*(5*r + q)] = cos(2.0*PI*r*q/5);
+			root[2*(5*r + q) + 1] = -sin(2.0*PI*r*q/5);
+		}
+	for( int r = 0; r < 3; ++r )
+		for( int q = 0; q < 3; ++q ){
+			root[50 + 2*(3*r + q)] = cos(2.0*PI*r*q/3);
+			root[50 + 2*(3*r + q) + 1] = -sin(2.0*PI*r*q/3);
+		}
+}
+
+int FFT::good_size ( const int n, const bool is_even )
+{
+	for( int i = std::max(1, n); ; ++i ){
+		if( is_even && i%2 != 0 ) continue;
+		int r = i;
+		while( r%2 == 0 ) r /= 2;
+		while( r%3 == 0 ) r /= 3;
+		while( r%5 == 0 ) r /= 5;
+		if( r == 1 ) return i;
+	}
+}
+
+void FFT::transform ( double* x, const int ld, const int len, const bool inverse, double* work ) const
+{
+	if( n == 1 ) return;
+
+	const double sgn = (inverse ? -1.0 : 1.0);
+	double* src = x; int ld_src = ld;
+	double* dst = work; int ld_dst = 2*len;
+	int Ns = 1;
+	for( int st = 0; st < radix.size(); ++st ){
+		const int R = radix[st], nR = n/R;
+		const double* tw = &twiddle[offset[st]];
+		const double* rt = &root[R == 5 ? 0 : 50];
+		const int lr = (R == 5 ? 5 : 3);
+
+		for( int j = 0; j < nR; ++j ){
+			const int k = j%Ns, d = (j/Ns)*Ns*R + k;
+			const double* a[5];
+			double* y[5];
+			for( int r = 0; r < R; ++r ){
+				a[r] = src + (long long)(j + r*nR)*ld_src;
+				y[r] = dst + (long long)(d + r*Ns)*ld_dst;
+			}
+
+			if( R == 2 ){
+				const double wr = tw[2*(k*R + 1)], wi = sgn*tw[2*(k*R + 1) + 1];
+				for( int b = 0; b < len; ++b ){
+					const double vr = wr*a[1][b] - wi*a[1][len+b], vi = wr*a[1][len+b] + wi*a[1][b];
+					y[0][b] = a[0][b] + vr; y[0][len+b] = a[0][len+b] + vi;
+					y[1][b] = a[0][b] - vr; y[1][len+b] = a[0][len+b] - vi;
+				}
+			}
+			else if( R == 4 ){
+				const double w1r = tw[2*(k*R + 1)], w1i = sgn*tw[2*(k*R + 1) + 1];
+				const double w2r = tw[2*(k*R + 2)], w2i = sgn*tw[2*(k*R + 2) + 1];
+				const double w3r = tw[2*(k*R + 3)], w3i = sgn*tw[2*(k*R + 3) + 1];
+				for( int b = 0; b < len; ++b ){
+					const double v0r = a[0][b], v0i = a[0][len+b];
+					const double v1r = w1r*a[1][b] - w1i*a[1][len+b], v1i = w1r*a[1][len+b] + w1i*a[1][b];
+					const double v2r = w2r*a[2][b] - w2i*a[2][len+b], v2i = w2r*a[2][len+b] + w2i*a[2][b];
+					const double v3r = w3r*a[3][b] - w3i*a[3][len+b], v3i = w3r*a[3][len+b] + w3i*a[3][b];
+					const double s0r = v0r + v2r, s0i = v0i + v2i, d0r = v0r - v2r, d0i = v0i - v2i;
+					const double s1r = v1r + v3r, s1i = v1i + v3i;
+					// (v1 - v3) multiplied by -i for the forward and i for the inverse.
+					const double d1r = sgn*(v1i - v3i), d1i = -sgn*(v1r - v3r);
+					y[0][b] = s0r + s1r; y[0][len+b] = s0i + s1i;
+					y[1][b] = d0r + d1r; y[1][len+b] = d0i + d1i;
+					y[2][b] = s0r - s1r; y[2][len+b] = s0i - s1i;
+					y[3][b] = d0r - d1r; y[3][len+b] = d0i - d1i;
+				}
+			}
+			else{
+				double wr[5], wi[5];
+				for( int r = 0; r < R; ++r ){
+					wr[r] = tw[2*(k*R + r)]; wi[r] = sgn*tw[2*(k*R + r) + 1];
+				}
+				for( int b = 0; b < len; ++b ){
+					double vr[5], vi[5];
+					for( int r = 0; r < R; ++r ){
+						vr[r] = wr[r]*a[r][b] - wi[r]*a[r][len+b];
+						vi[r] = wr[r]*a[r][len+b] + wi[r]*a[r][b];
+					}
+					for( int q = 0; q < R; ++q ){
+						double sr = 0.0, si = 0.0;
+						for( int r = 0; r < R; ++r ){
+							const double cr = rt[2*(lr*r + q)], ci = sgn*rt[2*(lr*r + q) + 1];
+							sr += cr*vr[r] - ci*vi[r];
+							si += cr*vi[r] + ci*vr[r];
+						}
+						y[q][b] = sr; y[q][len+b] = si;
+					}
+				}
+			}
+		}
+
+		std::swap(src, dst); std::swap(ld_src, ld_dst);
+		Ns *= R;
+	}
+
+	if( src != x )
+		for( int i = 0; i < n; ++i )
+			std::copy(src + (long long)i*ld_src, src + (long long)i*ld_src + 2*len, x + (long long)i*ld);
+}
+
+RealFFT2D::RealFFT2D ( const int P, const int Q ) : P(P), Q(Q), row(Q/2), col(P)
+{
+	const double PI = acos(-1.0);
+	// twiddle[2*k] = exp(-2 pi i k/Q) for k <= Q/2.
+	for( int k = 0; k <= Q/2; ++k ){
+		twiddle.push_back(cos(2.0*PI*k/Q));
+		twiddle.push_back(-sin(2.0*PI*k/Q));
+	}
+}
+
+// With Z the transform of the packed row and j' = (h - j)%h,
+// X[j] = (Z[j] + conj(Z[j']))/2 + T[j](Z[j] - conj(Z[j']))/2i and X[h-j] is given by
+// the same terms with the conjugate.
+void RealFFT2D::forward ( double* x, const int len, double* work ) const
+{
+	const int h = Q/2, ld = 2*len, ldr = (h + 1)*ld;
+
+	for( int p = 0; p < P; ++p ){
+		double* z = x + (long long)p*ldr;
+		row.transform(z, ld, len, false, work);
+
+		for( int j = 0; j <= h/2; ++j ){
+			double* a = z + (long long)j*ld;
+			double* c = z + (long long)((h - j)%h)*ld;
+			double* y = z + (long long)(h - j)*ld;
+			const double tr = twiddle[2*j], ti = twiddle[2*j + 1];
+			for( int b = 0; b < len; ++b ){
+				const double ar = a[b], ai = a[len+b], cr = c[b], ci = c[len+b];
+				const double er = 0.5*(ar + cr), ei = 0.5*(ai - ci);
+				const double or_ = 0.5*(ai + ci), oi = -0.5*(ar - cr);
+				const double sr = tr*or_ - ti*oi, si = tr*oi + ti*or_;
+				a[b] = er + sr; a[len+b] = ei + si;
+				if( j != h - j ){
+					y[b] = er - sr; y[len+b] = -(ei - si);
+				}
+			}
+		}
+	}
+
+	for( int k = 0; k <= h; ++k )
+		col.transform(x + (long long)k*ld, ldr, len, false, work);
+}
+
+// Z[j] = (X[j] + conj(X[h-j]))/2 + i conj(T[j])(X[j] - conj(X[h-j]))/2, then the
+// inverse transform of Z gives the packed row.
+void RealFFT2D::inverse ( double* x, const int len, double* work ) const
+{
+	const int h = Q/2, ld = 2*len, ldr = (h + 1)*ld;
+
+	for( int k = 0; k <= h; ++k )
+		col.transform(x + (long long)k*ld, ldr, len, true, work);
+
+	for( int p = 0; p < P; ++p ){
+		double* z = x + (long long)p*ldr;
+
+		for( int j = 0; j <= h/2; ++j ){
+			double* a = z + (long long)j*ld;
+			double* c = z + (long long)(h - j)*ld;
+			const double tr = twiddle[2*j], ti = twiddle[2*j + 1];
+			const double ur = twiddle[2*(h - j)], ui = twiddle[2*(h - j) + 1];
+			for( int b = 0; b < len; ++b ){
+				const double ar = a[b], ai = a[len+b], cr = c[b], ci = c[len+b];
+				// Z[j] from X[j] and X[h-j].
+				const double er = 0.5*(ar + cr), ei = 0.5*(ai - ci);
+				const double dr = 0.5*(ar - cr), di = 0.5*(ai + ci);
+				const double or_ = tr*dr + ti*di, oi = tr*di - ti*dr;
+				// Z[h-j] from X[h-j] and X[j].
+				const double fr = 0.5*(cr + ar), fi = 0.5*(ci - ai);
+				const double gr = 0.5*(cr - ar), gi = 0.5*(ci + ai);
+				const double pr = ur*gr + ui*gi, pi = ur*gi - ui*gr;
+
+				a[b] = er - oi; a[len+b] = ei + or_;
+				if( j != 0 && j != h - j ){
+					c[b] = fr - pi; c[len+b] = fi + pr;
+				}
+			}
+		}
+
+		row.transform(z, ld, len, true, work);
+	}
+}
+
+#endif
@@ -10,6 +10,10 @@
 class FullyConnected : public Layer
 {
 private:
+	void build_kernel ( Mat& kernel ) const;
+	std::vector<std::vector<Mat>> calc_gradient_interleaved ( const Mat& U, const Mat& delta );
+	std::vector<Mat> calc_delta_interleaved ( const Mat& U, const Mat& delta );
+	std::vector<Mat> apply_interleaved ( const Mat& U, bool use_func );
 public:
 	FullyConnected ( int prev_num_map, int prev_num_unit, int num_map, int num_unit,
 					 const std::shared_ptr<Function>& f, bool use_bias = true );
@@ -28,6 +32,8 @@ public:
 	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
 	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
 
+	void set_interleaved ( const bool interleaved );
+
 	void set_W( const std::string& filename );
 	void output_W ( const std::string& filename );
 
@@ -114,6 +120,8 @@ void FullyConnected::finalize ()
 
 std::vector<std::vector<FullyConnected::Mat>> FullyConnected::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
 {
+	if( is_interleaved ) return calc_gradient_interleaved(U[0], delta[0]);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
@@ -170,6 +178,8 @@ std::vector<std::vector<FullyConnected::Mat>> FullyConnected::calc_gradient ( co
 
 std::vector<FullyConnected::Mat> FullyConnected::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
 {
+	if( is_interleaved ) return calc_delta_interleaved(U[0], delta[0]);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
@@ -254,6 +264,8 @@ void FullyConnected::update_W ( const std::vector<std::vector<Mat>>& dW )
 
 std::vector<FullyConnected::Mat> FullyConnected::apply ( const std::vector<Mat>& U, bool use_func )
 {
+	if( is_interleaved ) return apply_interleaved(U[0], use_func);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
@@ -338,6 +350,202 @@ std::vector<FullyConnected::Mat> FullyConnected::apply ( const std::vector<Mat>&
 	return ret;
 }
 
+// W of all maps as one matrix for the interleaved layout. The row 1 + p*C + c
+// is the input unit p of the map c and the row 0 is the sum of biases, the
+// column u*num_map + i is own output unit u of the map i.
+void FullyConnected::build_kernel ( Mat& kernel ) const
+{
+	const int my_size = W[0][0].m, C = prev_num_map;
+	kernel = Mat::zeros(1 + prev_num_unit*C, my_size*num_map);
+#pragma omp parallel for
+	for( int u = 0; u < my_size; ++u )
+		for( int i = 0; i < num_map; ++i )
+			for( int c = 0; c < C; ++c ){
+				kernel(0, u*num_map + i) += W[i][c](u, 0);
+				for( int p = 0; p < prev_num_unit; ++p )
+					kernel(1 + p*C + c, u*num_map + i) = W[i][c](u, 1 + p);
+			}
+}
+
+// The interleaved layout computes all maps by one GEMM of the samples.
+std::vector<std::vector<FullyConnected::Mat>> FullyConnected::calc_gradient_interleaved ( const Mat& U, const Mat& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = prev_num_map, my_size = W[0][0].m, len = 1 + prev_num_unit*C;
+	int offset = 0;
+#ifdef USE_MPI
+	offset = rank*num_unit/nprocs;
+#endif
+	
+	std::vector<std::vector<Mat>> nabla(num_map, std::vector<Mat>(prev_num_map));
+	Mat U_ = (*prev_func)(U, false), V(B, len), D(my_size*num_map, B), G(my_size*num_map, len);
+	auto end = std::chrono::system_clock::now();
+	t_grad_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel
+	{
+#pragma omp for nowait
+		for( int b = 0; b < B; ++b ){
+			V(b, 0) = (is_use_bias ? 1.0 : 0.0);
+			for( int p = 0; p < prev_num_unit; ++p )
+				for( int c = 0; c < C; ++c )
+					V(b, 1 + p*C + c) = U_(p*B + b, c);
+		}
+#pragma omp for nowait
+		for( int u = 0; u < my_size; ++u )
+			for( int i = 0; i < num_map; ++i )
+				for( int b = 0; b < B; ++b )
+					D(u*num_map + i, b) = delta((offset + u)*B + b, i);
+	}
+	end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	if( my_size != 0 ) gemm(my_size*num_map, len, B, &D(0,0), B, &V(0,0), len, 0.0, &G(0,0), len);
+	end = std::chrono::system_clock::now();
+	t_grad_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int i = 0; i < num_map; ++i )
+		for( int c = 0; c < C; ++c ){
+			nabla[i][c] = Mat(my_size, 1 + prev_num_unit);
+			for( int u = 0; u < my_size; ++u ){
+				nabla[i][c](u, 0) = G(u*num_map + i, 0);
+				for( int p = 0; p < prev_num_unit; ++p )
+					nabla[i][c](u, 1 + p) = G(u*num_map + i, 1 + p*C + c);
+			}
+		}
+	end = std::chrono::system_clock::now();
+	t_grad_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_grad += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nabla;
+}
+
+std::vector<FullyConnected::Mat> FullyConnected::calc_delta_interleaved ( const Mat& U, const Mat& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = prev_num_map, my_size = W[0][0].m;
+	int offset = 0;
+#ifdef USE_MPI
+	offset = rank*num_unit/nprocs;
+#endif
+	Mat kernel, D(my_size*num_map, B), tmp = Mat::zeros(prev_num_unit*C, B);
+	build_kernel(kernel);
+	std::vector<Mat> nx_delta(1, Mat(prev_num_unit*B, C));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int u = 0; u < my_size; ++u )
+		for( int i = 0; i < num_map; ++i )
+			for( int b = 0; b < B; ++b )
+				D(u*num_map + i, b) = delta((offset + u)*B + b, i);
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	if( my_size != 0 ) gemm(prev_num_unit*C, B, my_size*num_map, &kernel(1,0), my_size*num_map, &D(0,0), B, 0.0, &tmp(0,0), B);
+	end = std::chrono::system_clock::now();
+	t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE, &tmp(0,0), tmp.m*tmp.n, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	Mat U_ = (*prev_func)(U, true);
+#pragma omp parallel for
+	for( int p = 0; p < prev_num_unit; ++p )
+		for( int b = 0; b < B; ++b )
+			for( int c = 0; c < C; ++c )
+				nx_delta[0](p*B + b, c) = tmp(p*C + c, b)*U_(p*B + b, c);
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+// The function is applied on one Mat per map, as Softmax normalizes a map.
+std::vector<FullyConnected::Mat> FullyConnected::apply_interleaved ( const Mat& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = prev_num_map, my_size = W[0][0].m, len = 1 + prev_num_unit*C;
+	int offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offs(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*B*num_map;
+		offs[i] = i*num_unit/nprocs*B*num_map;
+	}
+	offset = rank*num_unit/nprocs;
+#endif
+	Mat kernel, V(B, len), tmp(B, my_size*num_map);
+	build_kernel(kernel);
+	std::vector<Mat> ret(1, Mat(num_unit*B, num_map));
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int b = 0; b < B; ++b ){
+		V(b, 0) = (is_use_bias ? 1.0 : 0.0);
+		for( int p = 0; p < prev_num_unit; ++p )
+			for( int c = 0; c < C; ++c )
+				V(b, 1 + p*C + c) = U(p*B + b, c);
+	}
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	if( my_size != 0 ) gemm(B, my_size*num_map, len, &V(0,0), len, &kernel(0,0), my_size*num_map, 0.0, &tmp(0,0), my_size*num_map);
+	end = std::chrono::system_clock::now();
+	t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int u = 0; u < my_size; ++u )
+		for( int b = 0; b < B; ++b )
+			for( int i = 0; i < num_map; ++i )
+				ret[0]((offset + u)*B + b, i) = tmp(b, u*num_map + i);
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+				   &ret[0](0,0), &size[0], &offs[0], MPI_DOUBLE_PRECISION, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+	if( use_func ){
+		auto tmp_ret = convert_layout(ret, true, false, num_unit);
+		for( int i = 0; i < num_map; ++i )
+			tmp_ret[i] = (*func)(tmp_ret[i], false);
+		ret = convert_layout(tmp_ret, false, true, num_unit);
+	}
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return ret;
+}
+
 std::vector<std::vector<FullyConnected::Vec>> FullyConnected::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
 {
 	std::vector<Mat> tmp(prev_num_map);
@@ -353,7 +561,7 @@ std::vector<std::vector<FullyConnected::Vec>> FullyConnected::apply ( const std:
 					tmp[i](j,k) = u[k][i][j];
 	}
 	
-	auto U = apply(tmp, use_func);
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n, std::vector<Vec>(U.size(), Vec(U[0].m)));
 #pragma omp parallel for
 	for( int i = 0; i < U[0].n; ++i ){
@@ -365,6 +573,11 @@ std::vector<std::vector<FullyConnected::Vec>> FullyConnected::apply ( const std:
 	return ret;
 }
 
+void FullyConnected::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+}
+
 void FullyConnected::set_W ( const std::string& filename )
 {
 	std::ifstream ifs(filename, std::ios::binary);
@@ -2,20 +2,92 @@
 #define FUNCTION_HPP
 
 #include <cmath>
+#include <vector>
 #include <algorithm>
+#include <functional>
 
 #include "Matrix.hpp"
 
+// Piecewise linear table of f on the clamped domain [-range, range].
+// Values and slopes are kept in two flat arrays, so evaluation is an index
+// computation followed by two gathers and one FMA without any branch.
+class FunctionTable
+{
+public:
+	int size;
+	double range, scale;
+	std::vector<double> val, slope;
+
+	FunctionTable () :size(0), range(0.0), scale(0.0) {}
+	FunctionTable ( const std::function<double(double)>& f, const int size, const double range )
+		:size(size), range(range), scale(size/(2.0*range)), val(size+1), slope(size+1, 0.0)
+	{
+		for( int i = 0; i <= size; ++i ) val[i] = f(-range + i/scale);
+		for( int i = 0; i < size; ++i ) slope[i] = val[i+1] - val[i];
+	}
+
+	inline bool empty () const { return size == 0; }
+
+	inline Matrix<double> operator() ( const Matrix<double>& x ) const
+	{
+		Matrix<double> y(x.m, x.n);
+		const int mn = x.m*x.n;
+		const double lo = -range, hi = range, sc = scale;
+		const double* v = &val[0];
+		const double* d = &slope[0];
+
+#pragma omp parallel for
+		for( int i = 0; i < mn; ++i ){
+			const double t = (std::min(std::max(x.v[i], lo), hi) - lo)*sc;
+			const int idx = std::min((int)t, size-1);
+			y.v[i] = v[idx] + (t - idx)*d[idx];
+		}
+		cnt_flop += (long long)mn*5;
+
+		return y;
+	}
+
+	// maximum absolute error against f measured on num_sample points of the domain
+	double max_error ( const std::function<double(double)>& f, const int num_sample = 100000 ) const
+	{
+		Matrix<double> x(num_sample, 1);
+		for( int i = 0; i < num_sample; ++i ) x(i,0) = -range + 2.0*range*i/(num_sample-1);
+		auto y = (*this)(x);
+
+		double err = 0.0;
+		for( int i = 0; i < num_sample; ++i ) err = std::max(err, std::abs(y(i,0) - f(x(i,0))));
+		return err;
+	}
+};
+
 class Function
 {
 public:
 	virtual inline Matrix<double> operator() ( const Matrix<double>& x, const bool& isdiff ) = 0;
+
+	// Evaluate the forward function through a FunctionTable of the given size.
+	// This is meant for inference, derivatives are always computed exactly.
+	// Functions which have no table implementation ignore these calls.
+	virtual void set_table ( const int size, const double range ) {}
+	virtual void unset_table () {}
 };
 
 class LossFunction
 {
 public:
 	virtual inline Matrix<double> operator() ( const Matrix<double>& x, const Matrix<double>& d, const bool& isdiff ) = 0;
+
+	// Loss of the j-th column (one sample) of x against d.
+	// This neither allocates nor opens a parallel region, so that it can be
+	// called for every sample inside a parallel loop.
+	virtual inline double column ( const Matrix<double>& x, const Matrix<double>& d, const int& j ){
+		Matrix<double> x_(x.m, 1), d_(d.m, 1);
+		for( int k = 0; k < x.m; ++k ){
+			x_(k,0) = x(k,j);
+			d_(k,0) = d(k,j);
+		}
+		return (*this)(x_, d_, false)(0,0);
+	}
 };
 
 class Identity : public Function
@@ -54,11 +126,22 @@ public:
 
 class Sigmoid : public Function
 {
+	FunctionTable table;
 public:
 	double alpha;
 	Sigmoid( double alpha = 1.0 ) :alpha(alpha) {}
+
+	void set_table ( const int size, const double range ){
+		const double a = alpha;
+		table = FunctionTable([a](double x) -> double { return 1.0 / (1.0 + std::exp(-a*x)); }, size, range);
+	}
+	void unset_table (){
+		table = FunctionTable();
+	}
 	
 	inline Matrix<double> operator() ( const Matrix<double>& x, const bool& isdiff ){
+		if( !isdiff && !table.empty() ) return table(x);
+
 		Matrix<double> y(x.m, x.n);
 
 		if( isdiff ){
@@ -81,8 +164,18 @@ public:
 
 class Tanh : public Function
 {
+	FunctionTable table;
 public:
+	void set_table ( const int size, const double range ){
+		table = FunctionTable([](double x) -> double { return std::tanh(x); }, size, range);
+	}
+	void unset_table (){
+		table = FunctionTable();
+	}
+
 	inline Matrix<double> operator() ( const Matrix<double>& x, const bool& isdiff ){
+		if( !isdiff && !table.empty() ) return table(x);
+
 		Matrix<double> y(x.m, x.n);
 
 		if( isdiff ){
@@ -280,6 +373,15 @@ public:
 			return y;
 		}
 	}
+
+	inline double column ( const Matrix<double>& x, const Matrix<double>& d, const int& j ){
+		double y = 0.0;
+		for( int k = 0; k < x.m; ++k ){
+			double tmp = x(k,j) - d(k,j);
+			y += tmp*tmp;
+		}
+		return y;
+	}
 };
 
 class CrossEntropy : public LossFunction
@@ -307,6 +409,12 @@ public:
 			return 2.0*y;
 		}
 	}
+
+	inline double column ( const Matrix<double>& x, const Matrix<double>& d, const int& j ){
+		double y = 0.0;
+		for( int k = 0; k < x.m; ++k ) y -= d(k,j)*std::log(x(k,j));
+		return 2.0*y;
+	}
 };
 	
 #endif
@@ -0,0 +1,232 @@
+#ifndef GLOBALAVERAGEPOOLING_HPP
+#define GLOBALAVERAGEPOOLING_HPP
+
+#include "Layer.hpp"
+
+// Mean of all units of each map, the output has one unit per map. As a head of
+// a network it takes the place of a FullyConnected layer on the whole maps.
+class GlobalAveragePooling : public Layer
+{
+public:
+	GlobalAveragePooling( int prev_num_map, int prev_num_unit,
+						  const std::shared_ptr<Function>& f );
+
+#ifdef USE_MPI
+	void init( std::mt19937& m, MPI_Comm inner_world, MPI_Comm outer_world );
+#else
+	void init( std::mt19937& m );
+#endif
+	void finalize();
+
+	std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta );
+	void update_W ( const std::vector<std::vector<Mat>>& dW );
+
+	std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true );
+	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& u, bool use_func = true );
+
+	void set_interleaved ( const bool interleaved );
+
+	void set_W ( const std::string& filename );
+	void output_W ( const std::string& filename );
+
+#ifdef USE_MPI
+	void param_mix ();
+#endif
+};
+
+GlobalAveragePooling::GlobalAveragePooling( int prev_num_map, int prev_num_unit,
+											const std::shared_ptr<Function>& f )
+{
+	this->prev_num_map = this->num_map = prev_num_map;
+	this->prev_num_unit = prev_num_unit;
+	this->num_unit = 1;
+
+	t_apply = t_delta = t_grad = 0.0;
+	t_apply_init = t_apply_gemm = t_apply_repl = t_apply_comm = 0.0;
+	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
+	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
+
+	func = f;
+}
+
+#ifdef USE_MPI
+void GlobalAveragePooling::init ( std::mt19937& m, MPI_Comm inner_world, MPI_Comm outer_world )
+#else
+void GlobalAveragePooling::init ( std::mt19937& m )
+#endif
+{
+#ifdef USE_MPI
+	this->inner_world = inner_world;
+	this->outer_world = outer_world;
+
+	MPI_Comm_rank(inner_world, &rank);
+	MPI_Comm_size(inner_world, &nprocs);
+#endif
+
+	W = std::vector<std::vector<Mat>>();
+}
+
+void GlobalAveragePooling::finalize ()
+{
+
+}
+
+std::vector<std::vector<GlobalAveragePooling::Mat>> GlobalAveragePooling::calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	return std::vector<std::vector<Mat>>();
+}
+
+// delta of the single unit is known to every rank, so each rank spreads it to
+// all input units without communication.
+std::vector<GlobalAveragePooling::Mat> GlobalAveragePooling::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int len = delta[0].m*delta[0].n;
+	const double inv = 1.0/prev_num_unit;
+	std::vector<Mat> nx_delta(U.size(), Mat(U[0].m, U[0].n));
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	for( int i = 0; i < U.size(); ++i ){
+		beg = std::chrono::system_clock::now();
+		const double* d = &delta[i](0,0);
+		double* g = &nx_delta[i](0,0);
+#pragma omp parallel for
+		for( int j = 0; j < prev_num_unit; ++j )
+			for( int k = 0; k < len; ++k )
+				g[(long long)j*len + k] = inv*d[k];
+		end = std::chrono::system_clock::now();
+		t_delta_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		beg = std::chrono::system_clock::now();
+		nx_delta[i] = Mat::hadamard(nx_delta[i], (*prev_func)(U[i], true));
+		end = std::chrono::system_clock::now();
+		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	}
+
+	end = std::chrono::system_clock::now();
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
+void GlobalAveragePooling::update_W ( const std::vector<std::vector<Mat>>& dW )
+{
+
+}
+
+// A unit is a row of B samples of a map, or of B samples of all maps in the
+// interleaved layout. Each thread sums its units into its own row and the rows
+// are added at the end. The ranks sum their own band of the units and reduce
+// the sums.
+std::vector<GlobalAveragePooling::Mat> GlobalAveragePooling::apply ( const std::vector<Mat>& U, bool use_func )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = (is_interleaved ? U[0].m/prev_num_unit : U[0].n), len = (is_interleaved ? B*num_map : B);
+	int my_size = prev_num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*prev_num_unit/nprocs - rank*prev_num_unit/nprocs;
+	my_offset = rank*prev_num_unit/nprocs;
+#endif
+
+	const double inv = 1.0/prev_num_unit;
+	std::vector<Mat> ret(U.size(), is_interleaved ? Mat::zeros(B, num_map) : Mat::zeros(1, B));
+	auto end = std::chrono::system_clock::now();
+	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	for( int i = 0; i < U.size(); ++i ){
+		beg = std::chrono::system_clock::now();
+		const Mat U_ = (*prev_func)(U[i], false);
+		end = std::chrono::system_clock::now();
+		t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+		beg = std::chrono::system_clock::now();
+		const double* u = &U_(0,0);
+		double* v = &ret[i](0,0);
+#pragma omp parallel
+		{
+			std::vector<double> acc(len, 0.0);
+#pragma omp for nowait
+			for( int j = my_offset; j < my_offset + my_size; ++j ){
+				const double* a = u + (long long)j*len;
+				for( int k = 0; k < len; ++k ) acc[k] += a[k];
+			}
+#pragma omp critical
+			for( int k = 0; k < len; ++k ) v[k] += inv*acc[k];
+		}
+		end = std::chrono::system_clock::now();
+		t_apply_gemm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	}
+
+#ifdef USE_MPI
+	beg = std::chrono::system_clock::now();
+	for( int i = 0; i < ret.size(); ++i )
+		MPI_Allreduce(MPI_IN_PLACE, &ret[i](0,0), len, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+	end = std::chrono::system_clock::now();
+	t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+#endif
+
+	beg = std::chrono::system_clock::now();
+	if( use_func )
+		for( int i = 0; i < ret.size(); ++i )
+			ret[i] = (*func)(ret[i], false);
+	end = std::chrono::system_clock::now();
+	t_apply_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	end = std::chrono::system_clock::now();
+	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return ret;
+}
+
+std::vector<std::vector<GlobalAveragePooling::Vec>> GlobalAveragePooling::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
+{
+	std::vector<Mat> tmp(prev_num_map);
+	for( int i = 0; i < prev_num_map; ++i )
+		tmp[i] = Mat(u[0][0].size(), u.size());
+
+	for( int i = 0; i < prev_num_map; ++i )
+		for( int j = 0; j < u[0][0].size(); ++j )
+			for( int k = 0; k < u.size(); ++k )
+				tmp[i](j,k) = u[k][i][j];
+
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
+	std::vector<std::vector<Vec>> ret(U[0].n);
+	for( int i = 0; i < U[0].n; ++i ){
+		ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
+		for( int j = 0; j < U.size(); ++j )
+			for( int k = 0; k < U[0].m; ++k )
+				ret[i][j][k] = U[j](k,i);
+	}
+
+	return ret;
+}
+
+void GlobalAveragePooling::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+}
+
+void GlobalAveragePooling::set_W ( const std::string& filename )
+{
+	std::ifstream ifs(filename, std::ios::binary);
+}
+
+void GlobalAveragePooling::output_W ( const std::string& filename )
+{
+	std::ofstream ofs(filename, std::ios::binary);
+}
+
+#ifdef USE_MPI
+void GlobalAveragePooling::param_mix ()
+{
+
+}
+#endif
+
+#endif
@@ -14,6 +14,7 @@
 
 #include "Matrix.hpp"
 #include "Function.hpp"
+#include "Workspace.hpp"
 
 class Layer
 {
@@ -23,6 +24,15 @@ protected:
 
 	bool is_use_bias;
 	bool is_learning;
+	// Activations are one Mat of units x batch per map, or in the interleaved
+	// layout a single Mat of (units*batch) x maps whose row p*batch + b holds
+	// all maps of the unit p of the sample b.
+	bool is_interleaved;
+	// Under MPI a layer in the spatial decomposition keeps only own band of
+	// units of its output and nx_delta, [rank*units/nprocs, (rank+1)*units/nprocs)
+	// of every map, and leaves the others zero. Its input and delta are taken
+	// the same way after the units it reads from the other bands are exchanged.
+	bool is_spatial;
 
 	int prev_num_map, num_map;
 	int prev_num_unit, num_unit;
@@ -34,6 +44,8 @@ protected:
 
 	std::vector<std::vector<Mat>> W;
 	std::shared_ptr<Function> func, prev_func;
+	// scratch buffers, shared with the other layers of a network.
+	std::shared_ptr<Workspace> workspace;
 public:
 	double t_apply, t_delta, t_grad;
 	double t_apply_init, t_apply_gemm, t_apply_repl, t_apply_comm;
@@ -42,7 +54,7 @@ public:
 
 	double initial_value_range[2];
 	bool initial_value_range_default;
-	Layer() :is_learning(false), initial_value_range_default(true) {}
+	Layer() :is_learning(false), is_interleaved(false), is_spatial(false), workspace(new Workspace), initial_value_range_default(true) {}
 
 	inline void set_is_learning(const bool s) { is_learning = s; }
 	inline void set_initial_value_range(const double low, const double up)
@@ -64,6 +76,10 @@ public:
 	virtual void finalize () = 0;
 	virtual std::vector<Mat> calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta ) = 0;
 	virtual std::vector<std::vector<Mat>> calc_gradient ( const std::vector<Mat>& U, const std::vector<Mat>& delta ) = 0;
+	// calc_gradient and calc_delta on the same delta, nx_delta is set only if
+	// need_delta. Layers which share work between the two override this.
+	virtual std::vector<std::vector<Mat>> calc_backward ( const std::vector<Mat>& U, const std::vector<Mat>& delta,
+														  std::vector<Mat>& nx_delta, const bool need_delta = true );
 	virtual void update_W ( const std::vector<std::vector<Mat>>& dW ) = 0;
 
 	virtual std::vector<Mat> apply ( const std::vector<Mat>& U, bool use_func = true ) = 0;
@@ -79,10 +95,31 @@ public:
 	virtual int get_num_unit();
 	virtual int get_prev_num_map();
 	virtual int get_prev_num_unit();
+	virtual bool get_interleaved();
+	
+	// Layers which take and return the interleaved layout override this,
+	// the others stay in one Mat per map.
+	virtual void set_interleaved ( const bool interleaved );
+	static std::vector<Mat> convert_layout ( const std::vector<Mat>& U, const bool from, const bool to, const int num_unit );
+
+	// Layers which work on own bands of units override this, the others take
+	// and return all units.
+	virtual bool get_spatial ();
+	virtual void set_spatial ( const bool spatial );
+#ifdef USE_MPI
+	// units [lo, hi) of the input, or of delta if is_delta, read by the rank r.
+	virtual void halo_range ( const bool is_delta, const int r, int& lo, int& hi );
+	// receives the units read by own passes from the ranks owning them, and
+	// sends own units to the ranks reading them, from the neighbours only.
+	void exchange_halo ( std::vector<Mat>& U, const bool interleaved, const bool is_delta );
+	// collects all bands of the output, or of nx_delta if is_input.
+	void gather_band ( std::vector<Mat>& U, const bool interleaved, const bool is_input );
+#endif
 	
 	virtual void set_W ( const std::vector<std::vector<Mat>>& W );
 	virtual void set_function ( const std::shared_ptr<Function>& f );
 	virtual void set_prev_function ( const std::shared_ptr<Function>& f );
+	virtual void set_workspace ( const std::shared_ptr<Workspace>& workspace );
 	
 	virtual void set_W ( const std::string& filename ) = 0;
 	virtual void output_W ( const std::string& filename ) = 0;
@@ -92,6 +129,14 @@ public:
 #endif
 };
 
+std::vector<std::vector<Layer::Mat>> Layer::calc_backward ( const std::vector<Mat>& U, const std::vector<Mat>& delta,
+															std::vector<Mat>& nx_delta, const bool need_delta )
+{
+	std::vector<std::vector<Mat>> nabla = calc_gradient(U, delta);
+	if( need_delta ) nx_delta = calc_delta(U, delta);
+	return nabla;
+}
+
 std::vector<std::vector<Layer::Mat>> Layer::get_W ()
 {
 	return this->W;
@@ -127,6 +172,142 @@ int Layer::get_prev_num_unit()
 	return this->prev_num_unit;
 }
 
+bool Layer::get_interleaved()
+{
+	return this->is_interleaved;
+}
+
+void Layer::set_interleaved ( const bool interleaved )
+{
+}
+
+// Activations of num_unit units from the layout from to the layout to, true
+// stands for the interleaved one.
+std::vector<Layer::Mat> Layer::convert_layout ( const std::vector<Mat>& U, const bool from, const bool to, const int num_unit )
+{
+	if( from == to ) return U;
+
+	if( to ){
+		const int num_map = U.size(), B = U[0].n;
+		std::vector<Mat> ret(1, Mat(num_unit*B, num_map));
+#pragma omp parallel for
+		for( int j = 0; j < num_unit; ++j )
+			for( int k = 0; k < B; ++k )
+				for( int i = 0; i < num_map; ++i )
+					ret[0](j*B + k, i) = U[i](j, k);
+		return ret;
+	}
+	else{
+		const int num_map = U[0].n, B = U[0].m/num_unit;
+		std::vector<Mat> ret(num_map, Mat(num_unit, B));
+#pragma omp parallel for
+		for( int j = 0; j < num_unit; ++j )
+			for( int k = 0; k < B; ++k )
+				for( int i = 0; i < num_map; ++i )
+					ret[i](j, k) = U[0](j*B + k, i);
+		return ret;
+	}
+}
+
+bool Layer::get_spatial ()
+{
+	return this->is_spatial;
+}
+
+void Layer::set_spatial ( const bool spatial )
+{
+}
+
+#ifdef USE_MPI
+void Layer::halo_range ( const bool is_delta, const int r, int& lo, int& hi )
+{
+	const int N = (is_delta ? num_unit : prev_num_unit);
+	lo = r*N/nprocs; hi = (r+1)*N/nprocs;
+}
+
+void Layer::exchange_halo ( std::vector<Mat>& U, const bool interleaved, const bool is_delta )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int N = (is_delta ? num_unit : prev_num_unit);
+	const int B = (interleaved ? U[0].m/N : U[0].n), width = (interleaved ? B*U[0].n : B);
+	const int my_lo = rank*N/nprocs, my_hi = (rank+1)*N/nprocs;
+	int need_lo, need_hi;
+	halo_range(is_delta, rank, need_lo, need_hi);
+
+	// [ra, rb) of the rank r is sent or received as one message of all maps.
+	std::vector<int> send_a(nprocs, 0), send_b(nprocs, 0), recv_a(nprocs, 0), recv_b(nprocs, 0);
+	long long send_size = 0, recv_size = 0;
+	for( int r = 0; r < nprocs; ++r ){
+		if( r == rank ) continue;
+		int lo, hi;
+		halo_range(is_delta, r, lo, hi);
+		send_a[r] = std::max(lo, my_lo); send_b[r] = std::max(send_a[r], std::min(hi, my_hi));
+		recv_a[r] = std::max(need_lo, r*N/nprocs); recv_b[r] = std::max(recv_a[r], std::min(need_hi, (r+1)*N/nprocs));
+		send_size += (long long)(send_b[r] - send_a[r])*width*U.size();
+		recv_size += (long long)(recv_b[r] - recv_a[r])*width*U.size();
+	}
+
+	double* send_buf = workspace->get(0, send_size);
+	double* recv_buf = workspace->get(1, recv_size);
+	std::vector<MPI_Request> req;
+	long long send_pos = 0, recv_pos = 0;
+	for( int r = 0; r < nprocs; ++r ){
+		const long long len = (long long)(recv_b[r] - recv_a[r])*width;
+		if( len == 0 ) continue;
+		req.push_back(MPI_Request());
+		MPI_Irecv(recv_buf + recv_pos, len*U.size(), MPI_DOUBLE_PRECISION, r, 0, inner_world, &req.back());
+		recv_pos += len*U.size();
+	}
+	for( int r = 0; r < nprocs; ++r ){
+		const long long len = (long long)(send_b[r] - send_a[r])*width;
+		if( len == 0 ) continue;
+		for( int i = 0; i < U.size(); ++i )
+			std::copy(&U[i](0,0) + (long long)send_a[r]*width, &U[i](0,0) + (long long)send_a[r]*width + len, send_buf + send_pos + i*len);
+		req.push_back(MPI_Request());
+		MPI_Isend(send_buf + send_pos, len*U.size(), MPI_DOUBLE_PRECISION, r, 0, inner_world, &req.back());
+		send_pos += len*U.size();
+	}
+	std::vector<MPI_Status> stat(req.size());
+	if( !req.empty() ) MPI_Waitall(req.size(), &req[0], &stat[0]);
+
+	recv_pos = 0;
+	for( int r = 0; r < nprocs; ++r ){
+		const long long len = (long long)(recv_b[r] - recv_a[r])*width;
+		if( len == 0 ) continue;
+		for( int i = 0; i < U.size(); ++i )
+			std::copy(recv_buf + recv_pos + i*len, recv_buf + recv_pos + (i+1)*len, &U[i](0,0) + (long long)recv_a[r]*width);
+		recv_pos += len*U.size();
+	}
+
+	auto end = std::chrono::system_clock::now();
+	(is_delta ? t_delta_comm : t_apply_comm) += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+
+void Layer::gather_band ( std::vector<Mat>& U, const bool interleaved, const bool is_input )
+{
+	auto beg = std::chrono::system_clock::now();
+
+	const int N = (is_input ? prev_num_unit : num_unit);
+	const int width = (interleaved ? U[0].m/N*U[0].n : U[0].n);
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*N/nprocs - i*N/nprocs)*width;
+		offset[i] = i*N/nprocs*width;
+	}
+
+	std::vector<MPI_Request> req(U.size());
+	for( int i = 0; i < U.size(); ++i )
+		MPI_Iallgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
+						&U[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world, &req[i]);
+	std::vector<MPI_Status> stat(U.size());
+	MPI_Waitall(req.size(), &req[0], &stat[0]);
+
+	auto end = std::chrono::system_clock::now();
+	(is_input ? t_delta_comm : t_apply_comm) += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+}
+#endif
+
 void Layer::set_W ( const std::vector<std::vector<Mat>>& W )
 {
 	this->W = W;
@@ -142,4 +323,9 @@ void Layer::set_prev_function ( const std::shared_ptr<Function>& f )
 	prev_func = f;
 }
 
+void Layer::set_workspace ( const std::shared_ptr<Workspace>& workspace )
+{
+	this->workspace = workspace;
+}
+
 #endif
@@ -390,6 +390,99 @@ Matrix<double> operator * ( const Matrix<double>& m1, const Matrix<double>& m2 )
 	return ret;
 }
 
+// C = A*B + beta*C on row-major arrays with leading dimensions lda, ldb and ldc,
+// where A is m x l and B is l x n. Used to multiply blocks of a larger buffer.
+void gemm ( int m, int n, int l, const double* A, int lda, const double* B, int ldb, double beta, double* C, int ldc )
+{
+	if( m == 0 || n == 0 ) return;
+#if !defined(USE_EIGEN) && defined(USE_BLAS)
+	double ONE = 1.0;
+
+	if( l != 0 )
+		dgemm_("N", "N", &n, &m, &l, &ONE,
+			   B, &ldb, A, &lda,
+			   &beta, C, &ldc);
+#else
+#pragma omp parallel for
+	for( int i = 0; i < m; ++i ){
+		double* c = C + (long long)i*ldc;
+		for( int j = 0; j < n; ++j ) c[j] = (beta == 0.0 ? 0.0 : beta*c[j]);
+		for( int k = 0; k < l; ++k ){
+			const double a = A[(long long)i*lda + k];
+			const double* b = B + (long long)k*ldb;
+			for( int j = 0; j < n; ++j ) c[j] += a*b[j];
+		}
+	}
+#endif
+	cnt_flop += 2LL*m*n*l;
+}
+
+// C = A*B^T + beta*C as gemm, where B is n x l.
+void gemm_nt ( int m, int n, int l, const double* A, int lda, const double* B, int ldb, double beta, double* C, int ldc )
+{
+	if( m == 0 || n == 0 ) return;
+#if !defined(USE_EIGEN) && defined(USE_BLAS)
+	double ONE = 1.0;
+
+	if( l != 0 )
+		dgemm_("T", "N", &n, &m, &l, &ONE,
+			   B, &ldb, A, &lda,
+			   &beta, C, &ldc);
+#else
+#pragma omp parallel for
+	for( int i = 0; i < m; ++i ){
+		const double* a = A + (long long)i*lda;
+		double* c = C + (long long)i*ldc;
+		for( int j = 0; j < n; ++j ){
+			const double* b = B + (long long)j*ldb;
+			// 8 partial sums, so that the loop runs on vectors.
+			double s[8] = { 0.0 }, sum = 0.0;
+			int k = 0;
+			for( ; k + 8 <= l; k += 8 )
+				for( int t = 0; t < 8; ++t ) s[t] += a[k+t]*b[k+t];
+			for( ; k < l; ++k ) sum += a[k]*b[k];
+			for( int t = 0; t < 8; ++t ) sum += s[t];
+			c[j] = (beta == 0.0 ? sum : beta*c[j] + sum);
+		}
+	}
+#endif
+	cnt_flop += 2LL*m*n*l;
+}
+
+// C = A^T*B + beta*C as gemm, where A is l x m.
+void gemm_tn ( int m, int n, int l, const double* A, int lda, const double* B, int ldb, double beta, double* C, int ldc )
+{
+	if( m == 0 || n == 0 ) return;
+#if !defined(USE_EIGEN) && defined(USE_BLAS)
+	double ONE = 1.0;
+
+	if( l != 0 )
+		dgemm_("N", "T", &n, &m, &l, &ONE,
+			   B, &ldb, A, &lda,
+			   &beta, C, &ldc);
+#else
+	for( int i = 0; i < m; ++i ){
+		double* c = C + (long long)i*ldc;
+		for( int j = 0; j < n; ++j ) c[j] = (beta == 0.0 ? 0.0 : beta*c[j]);
+	}
+	// rows of A and B are taken in chunks, so that those of B stay in the cache
+	// for all rows of C.
+	for( int k0 = 0; k0 < l; k0 += 256 ){
+		const int k1 = std::min(l, k0 + 256);
+#pragma omp parallel for
+		for( int i = 0; i < m; ++i ){
+			double* c = C + (long long)i*ldc;
+			for( int k = k0; k < k1; ++k ){
+				const double a = A[(long long)k*lda + i];
+				const double* b = B + (long long)k*ldb;
+				for( int j = 0; j < n; ++j ) c[j] += a*b[j];
+			}
+		}
+	}
+#endif
+	cnt_flop += 2LL*m*n*l;
+}
+
 Matrix<float> operator * ( const Matrix<float>& m1, const Matrix<float>& m2 )
 {
 	int m = m1.m, n = m2.n, l = m1.n;
@@ -50,6 +50,8 @@ private:
 
 	std::shared_ptr<LossFunction> loss;
 	std::vector<std::shared_ptr<Layer>> layer;
+	// scratch buffers shared by all layers.
+	std::shared_ptr<Workspace> workspace;
 	
 	std::mt19937 mt;
 	std::uniform_real_distribution<double> d_rand;
@@ -61,6 +63,14 @@ private:
 	std::vector<std::vector<std::vector<Mat>>> calc_gradient (const std::vector<std::vector<Mat>>& U, const std::vector<Mat>& d);
 	void check_gradient ( int cnt, const std::vector<int>& idx, const std::vector<Mat>& X, const std::vector<Mat>& Y, const std::vector<std::vector<std::vector<Mat>>>& nabla_w );
 public:
+	// Result of Neuralnet::evaluate.
+	struct Evaluation
+	{
+		Vec loss;				// loss of each sample
+		double ave, min, max;	// statistics of the loss
+		double top1, topk;		// rate of samples whose label is in the top 1 and top k outputs
+	};
+
 	Neuralnet( const std::shared_ptr<LossFunction>& loss );
 #ifdef USE_MPI
 	Neuralnet( const std::shared_ptr<LossFunction>& loss, MPI_Comm outer_world, MPI_Comm inner_world );
@@ -70,6 +80,9 @@ public:
 	void set_LAMBDA ( const double& LAMBDA );
 	void set_BATCHSIZE ( const int& BATCH_SIZE );
 	void set_UPDATEITER ( const int& UPDATE_ITER );
+	void set_function_table ( const bool use_table, const int size = 4096, const double range = 8.0 );
+	// limit of scratch buffers in bytes, layers take smaller chunks to keep it.
+	void set_workspace_limit ( const long long bytes );
 
 	void add_layer( const std::shared_ptr<Layer>& layer );
 
@@ -88,10 +101,13 @@ public:
 	std::vector<Mat> apply ( const std::vector<Mat>& X ) const;
 	std::vector<std::vector<Vec>> apply ( const std::vector<std::vector<Vec>>& x ) const;
 
+	Evaluation evaluate ( const std::vector<Mat>& x, const std::vector<Mat>& y, const int k = 5 ) const;
+
 	void print_cost ( const std::vector<Mat>& x, const std::vector<Mat>& y ) const;
 	void print_cost ( const std::vector<std::vector<Vec>>& x, const std::vector<std::vector<Vec>>& y ) const;
 	void print_weight () const;
 	void print_gradient () const;
+	void print_workspace () const;
 
 	void set_W ( const std::string& filename );
 	void output_W ( const std::string& filename ) const;
@@ -103,6 +119,12 @@ std::vector<std::vector<std::vector<Neuralnet::Mat>>> Neuralnet::calc_gradient (
 {
 	const int num_layer = layer.size();
 	
+	// the loss is taken on one Mat per map.
+	const bool out_layout = layer[num_layer-1]->get_interleaved();
+	std::vector<Mat> V;
+	if( out_layout ) V = Layer::convert_layout(U[num_layer], true, false, layer[num_layer-1]->get_num_unit());
+	const std::vector<Mat>& Y = (out_layout ? V : U[num_layer]);
+
 	std::vector<Mat> delta(d.size());
 
 #pragma omp parallel	 // @@@ add
@@ -113,9 +135,10 @@ std::vector<std::vector<std::vector<Neuralnet::Mat>>> Neuralnet::calc_gradient (
 		std::shared_ptr<Function> f = layer[num_layer - 1]->get_function();
 #pragma omp for    // @@@ add
 		for (int i = 0; i < d.size(); ++i)
-			delta[i] = Mat::hadamard((*loss)((*f)(U[num_layer][i], false), d[i], true),
-			(*f)(U[num_layer][i], true));
+			delta[i] = Mat::hadamard((*loss)((*f)(Y[i], false), d[i], true),
+			(*f)(Y[i], true));
 	}
+	if( out_layout ) delta = Layer::convert_layout(delta, false, true, layer[num_layer-1]->get_num_unit());
 
 #ifdef DEBUG
 	int rank = 0;
@@ -128,25 +151,30 @@ std::vector<std::vector<std::vector<Neuralnet::Mat>>> Neuralnet::calc_gradient (
 #ifdef DEBUG
 		auto beg1 = std::chrono::system_clock::now();
 #endif
-		nabla_w[i] = layer[i]->calc_gradient(U[i], delta);
-#ifdef DEBUG
-		auto end1 = std::chrono::system_clock::now();
+		// U[i] is in the layout of the layer i-1.
+		const bool prev_layout = (i != 0 && layer[i-1]->get_interleaved()), layout = layer[i]->get_interleaved();
+		if( prev_layout != layout ) V = Layer::convert_layout(U[i], prev_layout, layout, layer[i]->get_prev_num_unit());
+		const std::vector<Mat>& U_ = (prev_layout != layout ? V : U[i]);
+#ifdef USE_MPI
+		// delta of the spatial decomposition has only own band.
+		if( layer[i]->get_spatial() && i != num_layer-1 && layer[i+1]->get_spatial() )
+			layer[i]->exchange_halo(delta, layout, true);
 #endif
 
-		if( i == 0 ){
-#ifdef DEBUG
-			if( rank == 0 ) printf("  layer %d, calc grad : %3lld\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(end1 - beg1).count());
-#endif
-			continue;
-		}
+		// the first layer needs no delta of its input.
+		std::vector<Mat> nx_delta;
+		nabla_w[i] = layer[i]->calc_backward(U_, delta, nx_delta, i != 0);
 #ifdef DEBUG
-		auto beg2 = std::chrono::system_clock::now();
+		auto end1 = std::chrono::system_clock::now();
+		if( rank == 0 ) printf("  layer %d, calc backward : %3lld\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(end1 - beg1).count());
 #endif
-		delta = layer[i]->calc_delta(U[i], delta);
-#ifdef DEBUG
-		auto end2 = std::chrono::system_clock::now();
-		if( rank == 0 ) printf("  layer %d, calc grad : %3lld, calc delta %3lld\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(end1 - beg1).count(), std::chrono::duration_cast<std::chrono::milliseconds>(end2 - beg2).count());
+		if( i == 0 ) continue;
+
+		delta.swap(nx_delta);
+#ifdef USE_MPI
+		if( layer[i]->get_spatial() && !layer[i-1]->get_spatial() ) layer[i]->gather_band(delta, layout, true);
 #endif
+		if( prev_layout != layout ) delta = Layer::convert_layout(delta, layout, prev_layout, layer[i]->get_prev_num_unit());
 	}
 	return nabla_w;
 }
@@ -222,7 +250,7 @@ void Neuralnet::check_gradient ( int cnt, const std::vector<int>& idx, const std
 
 //////////////////// PUBLIC FUNCTION ////////////////////
 Neuralnet::Neuralnet( const std::shared_ptr<LossFunction>& loss )
-	:EPS(1.0E-3), LAMBDA(0.0), BATCH_SIZE(1), UPDATE_ITER(-1), loss(loss)
+	:EPS(1.0E-3), LAMBDA(0.0), BATCH_SIZE(1), UPDATE_ITER(-1), loss(loss), workspace(new Workspace)
 {
 	_init();
 	mt = std::mt19937(time(NULL));
@@ -230,7 +258,7 @@ Neuralnet::Neuralnet( const std::shared_ptr<LossFunction>& loss )
 
 #ifdef USE_MPI
 Neuralnet::Neuralnet( const std::shared_ptr<LossFunction>& loss, MPI_Comm outer_world, MPI_Comm inner_world )
-	:EPS(1.0E-3), LAMBDA(0.0), BATCH_SIZE(1), UPDATE_ITER(-1), loss(loss), outer_world(outer_world), inner_world(inner_world)
+	:EPS(1.0E-3), LAMBDA(0.0), BATCH_SIZE(1), UPDATE_ITER(-1), loss(loss), workspace(new Workspace), outer_world(outer_world), inner_world(inner_world)
 {
 	_init();
 	int rank = 0, seed;
@@ -262,6 +290,24 @@ void Neuralnet::set_UPDATEITER ( const int& UPDATE_ITER )
 	this->UPDATE_ITER = UPDATE_ITER;
 }
 
+// Switch activation functions of all layers to table-driven evaluation.
+// This should be turned on after learning, when the network is used for inference.
+void Neuralnet::set_function_table ( const bool use_table, const int size, const double range )
+{
+	for( int i = 0; i < layer.size(); ++i ){
+		auto f = layer[i]->get_function();
+		if( use_table ) f->set_table(size, range);
+		else f->unset_table();
+	}
+}
+
+// Layers which have chosen their chunks keep them, so this should be set
+// before learning.
+void Neuralnet::set_workspace_limit ( const long long bytes )
+{
+	workspace->set_limit(bytes);
+}
+
 void Neuralnet::add_layer( const std::shared_ptr<Layer>& layer )
 {
 	std::shared_ptr<Function> f;
@@ -296,6 +342,7 @@ void Neuralnet::add_layer( const std::shared_ptr<Layer>& layer )
 
 	int idx = this->layer.size()-1;
 	this->layer[idx]->set_prev_function(f);
+	this->layer[idx]->set_workspace(workspace);
 #ifdef USE_MPI
 	this->layer[idx]->init(mt, inner_world, outer_world);
 #else
@@ -426,7 +473,16 @@ void Neuralnet::learning ( const std::vector<Mat>& X, const std::vector<Mat>& Y,
 #ifdef DEBUG
 			auto beg = std::chrono::system_clock::now();
 #endif
-			auto V = U[i];
+#ifdef USE_MPI
+			// U[i] keeps the halos for calc_gradient, or all bands for a layer
+			// out of the spatial decomposition.
+			if( i != 0 && layer[i-1]->get_spatial() ){
+				if( layer[i]->get_spatial() ) layer[i]->exchange_halo(U[i], layer[i-1]->get_interleaved(), false);
+				else layer[i-1]->gather_band(U[i], layer[i-1]->get_interleaved(), false);
+			}
+#endif
+			// U[i] is in the layout of the layer i-1 and the input in one Mat per map.
+			auto V = Layer::convert_layout(U[i], i != 0 && layer[i-1]->get_interleaved(), layer[i]->get_interleaved(), layer[i]->get_prev_num_unit());
 			if( i != 0 ){
 				std::shared_ptr<Function> f = layer[i-1]->get_function();
 				
@@ -434,15 +490,16 @@ void Neuralnet::learning ( const std::vector<Mat>& X, const std::vector<Mat>& Y,
 					V[j] = (*f)(V[j], false);
 			}
 
-			auto tmp = layer[i]->apply(V, false);
-			for( int j = 0; j < tmp.size(); ++j ){
-				U[i+1][j] = tmp[j];
-			}
+			U[i+1] = layer[i]->apply(V, false);
 #ifdef DEBUG
 			auto end = std::chrono::system_clock::now();
 			if( myrank == 0 ) printf("  layer %d : %3lld\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(end - beg).count());
 #endif
 		}
+#ifdef USE_MPI
+		if( layer[num_layer-1]->get_spatial() )
+			layer[num_layer-1]->gather_band(U[num_layer], layer[num_layer-1]->get_interleaved(), false);
+#endif
 #ifdef DEBUG
 		end = std::chrono::system_clock::now();
 		if( myrank == 0 ) printf("Feed : %3lld %d\n", std::chrono::duration_cast<std::chrono::milliseconds>(end - beg).count(), n);
@@ -558,9 +615,21 @@ std::vector<Neuralnet::Mat> Neuralnet::apply ( const std::vector<Mat>& X ) const
 	for( int i = 0; i < X.size(); ++i ) U[i] = X[i];
 	
 	for( int i = 0; i < num_layer; ++i ){
+		const bool prev_layout = (i != 0 && layer[i-1]->get_interleaved()), layout = layer[i]->get_interleaved();
+#ifdef USE_MPI
+		if( i != 0 && layer[i-1]->get_spatial() ){
+			if( layer[i]->get_spatial() ) layer[i]->exchange_halo(U, prev_layout, false);
+			else layer[i-1]->gather_band(U, prev_layout, false);
+		}
+#endif
+		if( prev_layout != layout ) U = Layer::convert_layout(U, prev_layout, layout, layer[i]->get_prev_num_unit());
 		U = layer[i]->apply(U);
 	}
+#ifdef USE_MPI
+	if( layer[num_layer-1]->get_spatial() ) layer[num_layer-1]->gather_band(U, layer[num_layer-1]->get_interleaved(), false);
+#endif
 
+	if( layer[num_layer-1]->get_interleaved() ) U = Layer::convert_layout(U, true, false, layer[num_layer-1]->get_num_unit());
 	return U;
 }
 
@@ -602,25 +671,69 @@ void Neuralnet::output_W ( const std::string& filename ) const
 	}
 }
 
-void Neuralnet::print_cost ( const std::vector<Mat>& x, const std::vector<Mat>& y ) const
+// Loss of each sample and answer rates in one parallel pass over the samples.
+// The label of a sample is the position of the largest supervised value among
+// all output maps, and its rank is the number of outputs larger than the label's one.
+Neuralnet::Evaluation Neuralnet::evaluate ( const std::vector<Mat>& x, const std::vector<Mat>& y, const int k ) const
 {
-	double error[3] = { 0.0 }, min_err = 1.0E100, max_err = 0.0;
 	auto v = apply(x);
-	for( int i = 0; i < y.size(); ++i ){	// @@  refer to i with y (y[i]) -> x.size()->y.size()
-		for( int j = 0; j < x[i].n; ++j ){
-			Mat v_(v[i].m, 1), y_(y[i].m, 1);
-			for( int k = 0; k < v[i].m; ++k ){
-				v_(k,0) = v[i](k,j);
-				y_(k,0) = y[i](k,j);
-			}
-			double sum = (*loss)(v_, y_, false)(0,0);
-		
-			min_err = std::min(min_err, sum);
-			max_err = std::max(max_err, sum);
-			error[0] += sum;
+	const int num_data = v[0].n;
+
+	Evaluation ret;
+	ret.loss = Vec(num_data);
+	ret.min = 1.0E100; ret.max = -1.0E100;
+
+	double sum = 0.0;
+	int num_top1 = 0, num_topk = 0;
+#pragma omp parallel
+	{
+		double min_err = 1.0E100, max_err = -1.0E100;
+
+#pragma omp for reduction(+:sum,num_top1,num_topk)
+		for( int j = 0; j < num_data; ++j ){
+			double err = 0.0;
+			for( int i = 0; i < y.size(); ++i ) err += loss->column(v[i], y[i], j);
+
+			ret.loss[j] = err;
+			sum += err;
+			min_err = std::min(min_err, err);
+			max_err = std::max(max_err, err);
+
+			int lab_map = 0, lab = 0;
+			for( int i = 0; i < y.size(); ++i )
+				for( int l = 0; l < y[i].m; ++l )
+					if( y[lab_map](lab, j) < y[i](l, j) ){
+						lab_map = i; lab = l;
+					}
+
+			const double val = v[lab_map](lab, j);
+			int rank = 0;
+			for( int i = 0; i < v.size(); ++i )
+				for( int l = 0; l < v[i].m; ++l )
+					if( val < v[i](l, j) ) ++rank;
+
+			if( rank == 0 ) ++num_top1;
+			if( rank < k ) ++num_topk;
+		}
+
+#pragma omp critical
+		{
+			ret.min = std::min(ret.min, min_err);
+			ret.max = std::max(ret.max, max_err);
 		}
 	}
-	error[0] /= x[0].n;
+
+	ret.ave = sum / num_data;
+	ret.top1 = (double)num_top1 / num_data;
+	ret.topk = (double)num_topk / num_data;
+
+	return ret;
+}
+
+void Neuralnet::print_cost ( const std::vector<Mat>& x, const std::vector<Mat>& y ) const
+{
+	auto score = evaluate(x, y);
+	double error[3] = { score.ave, 0.0, 0.0 }, min_err = score.min, max_err = score.max;
 
 	for( int i = 0; i < layer.size(); ++i ){
 		const auto& W = layer[i]->get_W();
@@ -743,4 +856,18 @@ void Neuralnet::print_gradient () const
 	}
 }
 
+void Neuralnet::print_workspace () const
+{
+	int rank = 0;
+#ifdef USE_MPI
+	MPI_Comm_rank(inner_world, &rank);
+#endif
+
+	if( rank == 0 ){
+		printf("Workspace:    Current    |     Peak      |     Limit     |\n");
+		printf("           %10.3f MB | %10.3f MB | %10.3f MB |\n",
+			   workspace->get_current()/1048576.0, workspace->get_peak()/1048576.0, workspace->get_limit()/1048576.0);
+	}
+}
+
 #endif
@@ -8,12 +8,24 @@ class Pooling : public Layer
 private:
 	int prev_ldu, ldu;
 	int m, n, stride, pad;
-	std::vector<Mat> S;
+	// S[i][j*B + b] is the input unit which won the unit my_offset + j of the map
+	// i for the sample b in the last apply, S[0][(j*B + b)*C + c] in the
+	// interleaved layout. calc_delta scatters delta to them.
+	std::vector<std::vector<int>> S;
+	// win_idx[win_ptr[j]..win_ptr[j+1]) are the input units in the window of
+	// the output unit j in the order of its rows, the padding is left out.
+	std::vector<int> win_ptr, win_idx;
+
+	std::vector<Mat> calc_delta_interleaved ( const Mat& U, const Mat& delta );
 public:
 	Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
 			 int num_map, int num_unit, int ldu,
 			 int m, int n, int stride, 
 			 const std::shared_ptr<Function>& f );
+	Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+			 int num_map, int num_unit, int ldu,
+			 int m, int n, int stride, int pad,
+			 const std::shared_ptr<Function>& f );
 	
 #ifdef USE_MPI
 	void init( std::mt19937& m, MPI_Comm inner_world, MPI_Comm outer_world );
@@ -31,6 +43,8 @@ public:
 	std::vector<Mat> unpooling ( const std::vector<Mat>& U );
 	std::vector<std::vector<Vec>> unpooling ( const std::vector<std::vector<Vec>>& u );
 
+	void set_interleaved ( const bool interleaved );
+
 	void set_W ( const std::string& filename );
 	void output_W ( const std::string& filename );
 
@@ -43,6 +57,14 @@ Pooling::Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
 				  int num_map, int num_unit, int ldu,
 				  int m, int n, int stride, 
 				  const std::shared_ptr<Function>& f )
+	: Pooling(prev_num_map, prev_num_unit, prev_ldu, num_map, num_unit, ldu, m, n, stride, 0, f)
+{
+}
+
+Pooling::Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
+				  int num_map, int num_unit, int ldu,
+				  int m, int n, int stride, int pad,
+				  const std::shared_ptr<Function>& f )
 {
 	this->prev_num_map = prev_num_map;
 	this->prev_num_unit = prev_num_unit;
@@ -57,7 +79,7 @@ Pooling::Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
 	t_delta_init = t_delta_gemm = t_delta_repl = t_delta_comm = 0.0;
 	t_grad_init = t_grad_gemm = t_grad_repl = t_grad_comm = 0.0;
 
-	this->m = m; this->n = n; this->stride = stride; this->pad = 0;
+	this->m = m; this->n = n; this->stride = stride; this->pad = pad;
 
 	int rank = 0;
 #ifdef USE_MPI
@@ -85,6 +107,24 @@ Pooling::Pooling( int prev_num_map, int prev_num_unit, int prev_ldu,
 			printf("          Estimate height = %d.\n", (prev_num_unit/prev_ldu + 2*pad - m)/stride + 1);
 			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
 		}
+	if( pad >= m || pad >= n )
+		if( rank == 0 ){
+			printf("WARNING : Padding is not smaller than the window on Pooling layer.\n");
+			printf("          Layer details : output size[%d x %d], filter size[%d x %d], stride %d, padding %d, number of map %d.\n", num_unit/ldu, ldu, m, n, stride, pad, num_map);
+		}
+
+	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	win_ptr = std::vector<int>(num_unit + 1, 0);
+	for( int j = 0; j < num_unit; ++j ){
+		const int y = j/ldu, x = j%ldu;
+		for( int s = 0; s < m; ++s )
+			for( int t = 0; t < n; ++t ){
+				const int nx = stride*x + t - pad, ny = stride*y + s - pad;
+				if( nx < 0 || nx >= X || ny < 0 || ny >= Y ) continue;
+				win_idx.push_back(ny*prev_ldu + nx);
+			}
+		win_ptr[j+1] = win_idx.size();
+	}
 
 	func = f;
 }
@@ -116,64 +156,56 @@ std::vector<std::vector<Pooling::Mat>> Pooling::calc_gradient ( const std::vecto
 	return std::vector<std::vector<Mat>>();
 }
 
+// The winners of apply are given delta of own units, so the derivative of
+// prev_func is taken at them only. The maps are independent and each thread
+// takes whole maps, so that overlapped windows add to the same units safely.
 std::vector<Pooling::Mat> Pooling::calc_delta ( const std::vector<Mat>& U, const std::vector<Mat>& delta )
 {
+	if( is_interleaved ) return calc_delta_interleaved(U[0], delta[0]);
+
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
+	const int B = U[0].n;
 	int my_size = num_unit, my_offset = 0;
 #ifdef USE_MPI
 	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
 	my_offset = rank*num_unit/nprocs;
 #endif
+	// calc_delta without apply of the same mini-batch.
+	if( S.size() != num_map || S[0].size() != (long long)my_size*B ) apply(U, false);
 
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
-	std::vector<Mat> nx_delta(prev_num_map);
+	std::vector<Mat> nx_delta(prev_num_map, Mat::zeros(prev_num_unit, B));
+	Mat D(num_map*my_size, B);
+#pragma omp parallel for
+	for( int r = 0; r < num_map*my_size; ++r ){
+		const int i = r/my_size, j = r%my_size;
+		for( int k = 0; k < B; ++k ) D(r, k) = U[i](S[i][j*B + k], k);
+	}
+	D = (*prev_func)(D, true);
 	auto end = std::chrono::system_clock::now();
 	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
-	for( int i = 0; i < prev_num_map; ++i ){
-		beg = std::chrono::system_clock::now();
-		auto U_apply = (*prev_func)(U[i], false);
-		auto U_diff = (*prev_func)(U[i], true);
-		nx_delta[i] = Mat::zeros(U[i].m, U[i].n);
-
-		const int gap = prev_ldu + 2*pad;
+	beg = std::chrono::system_clock::now();
 #pragma omp parallel for
+	for( int i = 0; i < num_map; ++i )
 		for( int j = 0; j < my_size; ++j ){
-			const int x = (j + my_offset)%ldu, y = (j + my_offset)/ldu;
-
-			for( int k = 0; k < U_apply.n; ++k ){
-				int s_idx = -1;
-				double val = -1E100;
-				
-				for( int s = 0; s < m; ++s )
-					for( int t = 0; t < n; ++t ){
-						const int idx = stride*x + t + s*gap + stride*y*gap;
-						const int nx = idx%gap - pad, ny = idx/gap - pad;
-
-						if( nx < 0 || nx >= X || ny < 0 || ny >= Y ) continue;
-
-						if( s_idx == -1 || val < U_apply(ny*prev_ldu + nx, k) ){
-							val = U_apply(ny*prev_ldu + nx, k);
-							s_idx = ny*prev_ldu + nx;
-						}
-					}
-				
-				nx_delta[i](s_idx, k) += delta[i](j + my_offset, k) * U_diff(s_idx, k);
-			}
+			const int* s_idx = &S[i][j*B];
+			const double* d = &delta[i](my_offset + j, 0);
+			const double* g = &D(i*my_size + j, 0);
+			for( int k = 0; k < B; ++k )
+				nx_delta[i](s_idx[k], k) += d[k]*g[k];
 		}
-		end = std::chrono::system_clock::now();
-		t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-		
-		beg = std::chrono::system_clock::now();
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
 #ifdef USE_MPI
-		MPI_Allreduce(MPI_IN_PLACE, &nx_delta[i](0,0), U[i].m*U[i].n, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+	for( int i = 0; i < prev_num_map; ++i )
+		MPI_Allreduce(MPI_IN_PLACE, &nx_delta[i](0,0), prev_num_unit*B, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
 #endif
-		end = std::chrono::system_clock::now();
-		t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
-	}
 	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
 	
 	return nx_delta;
@@ -184,59 +216,60 @@ void Pooling::update_W ( const std::vector<std::vector<Mat>>& dW )
 	
 }
 
+// A unit is a row of B samples of a map, or of B samples of all maps in the
+// interleaved layout, and the window is taken from the table. The comparison
+// runs along the row without branches, so that it is vectorized over the
+// mini-batch, and the first of equal values wins as in the order of the window.
 std::vector<Pooling::Mat> Pooling::apply ( const std::vector<Mat>& U, bool use_func )
 {
 	auto tot_beg = std::chrono::system_clock::now();
 	auto beg = tot_beg;
 
+	const int B = (is_interleaved ? U[0].m/prev_num_unit : U[0].n), len = (is_interleaved ? B*num_map : B);
 	int my_size = num_unit, my_offset = 0;
 #ifdef USE_MPI
 	std::vector<int> size(nprocs), offset(nprocs);
 	for( int i = 0; i < nprocs; ++i ){
-		size[i] = ((i+1)*my_size/nprocs - i*my_size/nprocs)*U[0].n;
-		offset[i] = i*my_size/nprocs*U[0].n;
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*len;
+		offset[i] = i*num_unit/nprocs*len;
 	}
 
-	my_size = size[rank]/U[0].n;
-	my_offset = offset[rank]/U[0].n;
+	my_size = size[rank]/len;
+	my_offset = offset[rank]/len;
 #endif
 	
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
-	std::vector<Mat> new_S(num_map, Mat(num_unit, U[0].n));
-	std::vector<Mat> ret(num_map);
+	std::vector<Mat> ret(U.size(), is_interleaved ? Mat(num_unit*B, num_map) : Mat(num_unit, B));
+	S.resize(U.size());
+	for( int i = 0; i < U.size(); ++i ) S[i].resize((long long)my_size*len);
+	Mat tmp(is_interleaved ? my_size*B : my_size, is_interleaved ? num_map : B);
 	auto end = std::chrono::system_clock::now();
 	t_apply_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 
-	Mat tmp(my_size, U[0].n);
-	for( int i = 0; i < num_map; ++i ){
+	for( int i = 0; i < U.size(); ++i ){
 		beg = std::chrono::system_clock::now();
-		ret[i] = Mat(num_unit, U[0].n);
-		Mat U_ = (*prev_func)(U[i], false);
+		const Mat U_ = (*prev_func)(U[i], false);
+		const double* u = &U_(0,0);
 
-		const int gap = prev_ldu + 2*pad;
 #pragma omp parallel for
 		for( int j = 0; j < my_size; ++j ){
-			const int x = (j + my_offset)%ldu, y = (j + my_offset)/ldu;
-
-			for( int k = 0; k < U_.n; ++k ){
-				int s_idx = -1;
-				double val = -1E100;
-
-				for( int s = 0; s < m; ++s )
-					for( int t = 0; t < n; ++t ){
-						const int idx = stride*x + t + s*gap + stride*y*gap;
-						const int nx = idx%gap - pad, ny = idx/gap - pad;
-						
-						if( nx < 0 || nx >= X || ny < 0 || ny >= Y ) continue;
-
-						if( s_idx == -1 || val < U_(ny*prev_ldu + nx, k) ){
-							val = U_(ny*prev_ldu + nx, k);
-							s_idx = ny*prev_ldu + nx;
-						}
-					}
-
-				tmp(j, k) = val;
-				new_S[i](j + my_offset, k) = s_idx;
+			double* val = &tmp(0,0) + (long long)j*len;
+			int* idx = &S[i][(long long)j*len];
+			const int q_beg = win_ptr[my_offset + j], q_end = win_ptr[my_offset + j + 1];
+
+			const int p0 = win_idx[q_beg];
+			const double* a0 = u + (long long)p0*len;
+			for( int l = 0; l < len; ++l ){
+				val[l] = a0[l];
+				idx[l] = p0;
+			}
+			for( int q = q_beg + 1; q < q_end; ++q ){
+				const int p = win_idx[q];
+				const double* a = u + (long long)p*len;
+				for( int l = 0; l < len; ++l ){
+					const bool is_max = val[l] < a[l];
+					val[l] = (is_max ? a[l] : val[l]);
+					idx[l] = (is_max ? p : idx[l]);
+				}
 			}
 		}
 
@@ -249,8 +282,6 @@ std::vector<Pooling::Mat> Pooling::apply ( const std::vector<Mat>& U, bool use_f
 #ifdef USE_MPI
 		MPI_Allgatherv(&tmp(0,0), size[rank], MPI_DOUBLE_PRECISION,
 					   &ret[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
-		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_DOUBLE_PRECISION,
-					   &new_S[i](0,0), &size[0], &offset[0], MPI_DOUBLE_PRECISION, inner_world);
 #else
 		ret[i] = tmp;
 #endif
@@ -258,13 +289,60 @@ std::vector<Pooling::Mat> Pooling::apply ( const std::vector<Mat>& U, bool use_f
 		t_apply_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
 	}
 
-	S = new_S;
 	end = std::chrono::system_clock::now();
 	t_apply += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
 
 	return ret;
 }
 
+// Each thread takes samples, so that overlapped windows add to different rows.
+std::vector<Pooling::Mat> Pooling::calc_delta_interleaved ( const Mat& U, const Mat& delta )
+{
+	auto tot_beg = std::chrono::system_clock::now();
+	auto beg = tot_beg;
+
+	const int B = U.m/prev_num_unit, C = prev_num_map;
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	my_size = (rank+1)*num_unit/nprocs - rank*num_unit/nprocs;
+	my_offset = rank*num_unit/nprocs;
+#endif
+	if( S.size() != 1 || S[0].size() != (long long)my_size*B*C ) apply(std::vector<Mat>(1, U), false);
+
+	std::vector<Mat> nx_delta(1, Mat::zeros(U.m, U.n));
+	Mat D(my_size*B, C);
+#pragma omp parallel for
+	for( int r = 0; r < my_size*B; ++r )
+		for( int c = 0; c < C; ++c )
+			D(r, c) = U(S[0][(long long)r*C + c]*B + r%B, c);
+	D = (*prev_func)(D, true);
+	auto end = std::chrono::system_clock::now();
+	t_delta_init += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#pragma omp parallel for
+	for( int k = 0; k < B; ++k )
+		for( int j = 0; j < my_size; ++j ){
+			const int* s_idx = &S[0][((long long)j*B + k)*C];
+			const double* d = &delta((my_offset + j)*B + k, 0);
+			const double* g = &D(j*B + k, 0);
+			for( int c = 0; c < C; ++c )
+				nx_delta[0](s_idx[c]*B + k, c) += d[c]*g[c];
+		}
+	end = std::chrono::system_clock::now();
+	t_delta_repl += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+
+	beg = std::chrono::system_clock::now();
+#ifdef USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE, &nx_delta[0](0,0), U.m*U.n, MPI_DOUBLE_PRECISION, MPI_SUM, inner_world);
+#endif
+	end = std::chrono::system_clock::now();
+	t_delta_comm += std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count()/1e9;
+	t_delta += std::chrono::duration_cast<std::chrono::nanoseconds>(end - tot_beg).count()/1e9;
+
+	return nx_delta;
+}
+
 std::vector<std::vector<Pooling::Vec>> Pooling::apply ( const std::vector<std::vector<Vec>>& u, bool use_func )
 {
 	std::vector<Mat> tmp(prev_num_map);
@@ -276,7 +354,7 @@ std::vector<std::vector<Pooling::Vec>> Pooling::apply ( const std::vector<std::v
 			for( int k = 0; k < u.size(); ++k )
 				tmp[i](j,k) = u[k][i][j];
 	
-	auto U = apply(tmp, use_func);
+	auto U = convert_layout(apply(convert_layout(tmp, false, is_interleaved, prev_num_unit), use_func), is_interleaved, false, num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n);
 	for( int i = 0; i < U[0].n; ++i ){
 		ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
@@ -288,27 +366,45 @@ std::vector<std::vector<Pooling::Vec>> Pooling::apply ( const std::vector<std::v
 	return ret;
 }
 
-std::vector<Pooling::Mat> Pooling::unpooling ( const std::vector<Mat>& U )
+std::vector<Pooling::Mat> Pooling::unpooling ( const std::vector<Mat>& V )
 {
-	const int Y = prev_num_unit/prev_ldu, X = prev_ldu;
+	// computed on one Mat per map.
+	const std::vector<Mat> U = convert_layout(V, is_interleaved, false, num_unit);
+	const int B = U[0].n;
 	std::vector<Mat> ret(num_map);
 
+	// the winners of all units from own units of the ranks.
+	int my_size = num_unit, my_offset = 0;
+#ifdef USE_MPI
+	std::vector<int> size(nprocs), offset(nprocs);
+	for( int i = 0; i < nprocs; ++i ){
+		size[i] = ((i+1)*num_unit/nprocs - i*num_unit/nprocs)*B;
+		offset[i] = i*num_unit/nprocs*B;
+	}
+
+	my_size = size[rank]/B;
+	my_offset = offset[rank]/B;
+#endif
+	std::vector<std::vector<int>> S_(num_map, std::vector<int>(num_unit*B));
+	for( int i = 0; i < num_map; ++i ){
+		for( int j = 0; j < my_size*B; ++j )
+			S_[i][my_offset*B + j] = (is_interleaved ? S[0][(long long)j*num_map + i] : S[i][j]);
+#ifdef USE_MPI
+		MPI_Allgatherv(MPI_IN_PLACE, size[rank], MPI_INT,
+					   &S_[i][0], &size[0], &offset[0], MPI_INT, inner_world);
+#endif
+	}
+
 //@@
 #pragma omp parallel for
 	for( int i = 0; i < num_map; ++i ){
-		ret[i] = Mat(prev_num_unit, U[0].n);
-		for( int j = 0; j < U[0].n; ++j ){
-			for( int y = 0; y < Y; y += stride )
-				for( int x = 0; x < X; x += stride ){
-					int idx = S[i](x/stride + (y/stride)*ldu, j);
-					double val = U[i](x+prev_ldu*y,j);
-
-					ret[i](idx,j) = U[i](x/stride + (y/stride)*ldu,j);
-				}
-		}
+		ret[i] = Mat::zeros(prev_num_unit, B);
+		for( int j = 0; j < num_unit; ++j )
+			for( int k = 0; k < B; ++k )
+				ret[i](S_[i][j*B + k], k) = U[i](j, k);
 	}
 
-	return ret;
+	return convert_layout(ret, false, is_interleaved, prev_num_unit);
 }
 
 std::vector<std::vector<Pooling::Vec>> Pooling::unpooling ( const std::vector<std::vector<Vec>>& u )
@@ -322,7 +418,7 @@ std::vector<std::vector<Pooling::Vec>> Pooling::unpooling ( const std::vector<st
 			for( int k = 0; k < u.size(); ++k )
 				tmp[i](j,k) = u[k][i][j];
 	
-	auto U = unpooling(tmp);
+	auto U = convert_layout(unpooling(convert_layout(tmp, false, is_interleaved, num_unit)), is_interleaved, false, prev_num_unit);
 	std::vector<std::vector<Vec>> ret(U[0].n);
 	for( int i = 0; i < U[0].n; ++i ){
 		ret[i] = std::vector<Vec>(U.size(), Vec(U[0].m));
@@ -334,6 +430,11 @@ std::vector<std::vector<Pooling::Vec>> Pooling::unpooling ( const std::vector<st
 	return ret;
 }
 
+void Pooling::set_interleaved ( const bool interleaved )
+{
+	is_interleaved = interleaved;
+}
+
 void Pooling::set_W ( const std::string& filename )
 {
 	std::ifstream ifs(filename, std::ios::binary);
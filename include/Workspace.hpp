@@ -0,0 +1,62 @@
+#ifndef WORKSPACE_HPP
+#define WORKSPACE_HPP
+
+#include <vector>
+#include <algorithm>
+
+// Scratch buffers for the passes of layers. The layers of a network run one
+// after another and share one Workspace, so every buffer is reused by all of
+// them and only grows to the largest request. Once each shape of mini-batch
+// has been seen, the passes allocate nothing. Layers choose their chunks so
+// that the buffers of each pass stay within the limit in bytes.
+class Workspace
+{
+	std::vector<std::vector<double>> buf;
+	long long limit, peak;
+public:
+	Workspace ( const long long limit = 1LL<<28 ) : limit(limit), peak(0) {}
+
+	// buffer id of at least size doubles. Its contents are not kept between
+	// passes, and it is valid until the next get of the same id.
+	double* get ( const int id, const long long size );
+	void release ();
+
+	// buffers over a lowered limit are freed, and taken again within it.
+	void set_limit ( const long long bytes );
+	long long get_limit () const { return limit; }
+	// bytes of all buffers now and the most of them so far.
+	long long get_current () const;
+	long long get_peak () const { return peak; }
+};
+
+double* Workspace::get ( const int id, const long long size )
+{
+	if( (int)buf.size() <= id ) buf.resize(id + 1);
+	if( (long long)buf[id].size() < size ){
+		std::vector<double>().swap(buf[id]);
+		buf[id].resize(size);
+		peak = std::max(peak, get_current());
+	}
+
+	return (buf[id].empty() ? NULL : &buf[id][0]);
+}
+
+void Workspace::set_limit ( const long long bytes )
+{
+	limit = bytes;
+	if( get_current() > limit ) release();
+}
+
+void Workspace::release ()
+{
+	std::vector<std::vector<double>>().swap(buf);
+}
+
+long long Workspace::get_current () const
+{
+	long long ret = 0;
+	for( int i = 0; i < (int)buf.size(); ++i ) ret += sizeof(double)*buf[i].size();
+	return ret;
+}
+
+#endif